@@ -0,0 +1,25 @@
+#!/bin/bash
+# Regenerates tests/golden/<case>.baseline.pcd, the outputs the regression
+# test pins the reference and float paths to: writes each case as ascii
+# (regression_test --write-inputs) and flattens it with the original
+# flatten_pcl.cpp, built as the first commit built it.
+# Usage: _misc/baseline_golden.sh [build_dir]
+set -e
+root="$(cd "$(dirname "$0")/.." && pwd)"
+build="${1:-$root/build}"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+first="$(git -C "$root" rev-list --max-parents=0 HEAD)"
+mkdir "$work/src" "$work/cases"
+git -C "$root" archive "$first" | tar -x -C "$work/src"
+(cd "$work/src" && g++ flatten_pcl.cpp util.cpp -std=c++11 -o run_flatten_pcl -lboost_filesystem -lboost_system)
+
+"$build/regression_test" "$root/tests" --write-inputs "$work/cases"
+for input in "$work/cases"/*.pcd; do
+  name="$(basename "$input" .pcd)"
+  # it names the output after the first '.' of its argument, so pass a bare name
+  (cd "$work/cases" && "$work/src/run_flatten_pcl" "$name.pcd" >/dev/null)
+  cp "$work/cases/${name}_flat.pcd" "$root/tests/golden/$name.baseline.pcd"
+  echo "tests/golden/$name.baseline.pcd"
+done
@@ -0,0 +1,72 @@
+#!/bin/bash
+# Builds bench_flatten in each build configuration and prints the stage
+# times of each (best of RUNS runs) with its speedup over the first.
+# Usage: _misc/bench_configs.sh [num_points] [work_dir]
+set -e
+root="$(cd "$(dirname "$0")/.." && pwd)"
+points="${1:-2000000}"
+work="${2:-$root/_bench_configs}"
+runs="${RUNS:-3}"
+
+# name, then cmake arguments
+configs=(
+  "unoptimized|-DCMAKE_BUILD_TYPE=None"
+  "release|-DCMAKE_BUILD_TYPE=Release -DFLATTEN_LTO=OFF -DFLATTEN_CLONES=OFF"
+  "+lto|-DCMAKE_BUILD_TYPE=Release -DFLATTEN_LTO=ON -DFLATTEN_CLONES=OFF"
+  "+dispatch|-DCMAKE_BUILD_TYPE=Release -DFLATTEN_LTO=ON -DFLATTEN_CLONES=ON"
+  "+pgo|pgo"
+  "native|-DCMAKE_BUILD_TYPE=Release -DFLATTEN_LTO=ON -DFLATTEN_CLONES=OFF -DFLATTEN_NATIVE=ON"
+)
+dispatch_args="-DCMAKE_BUILD_TYPE=Release -DFLATTEN_LTO=ON -DFLATTEN_CLONES=ON"
+
+names=()
+for config in "${configs[@]}"; do
+  name="${config%%|*}"
+  args="${config#*|}"
+  dir="$work/${name#+}"
+  echo "== Building $name" >&2
+  if [ "$args" = pgo ]; then
+    "$root/_misc/pgo_build.sh" "$dir" "" $dispatch_args -DFLATTEN_TOOLS_DIR="$dir" >/dev/null
+  else
+    cmake -S "$root" -B "$dir" $args -DFLATTEN_TOOLS_DIR="$dir" >/dev/null
+    cmake --build "$dir" -j"$(nproc)" --target bench_flatten >/dev/null
+  fi
+  for run in $(seq "$runs"); do
+    "$dir/bench_flatten" "$points" > "$dir/bench_$run.txt"
+  done
+  names+=("$name")
+done
+
+# Stage rows are "  <stage> <ms> ms ..." under a section line ending in ":"
+for name in "${names[@]}"; do
+  for f in "$work/${name#+}"/bench_*.txt; do
+    awk -v config="$name" '
+      /:$/ { section = $0; sub(/ \(.*|:$/, "", section) }
+      /^  / {
+        for (i = 3; i <= NF && $i != "ms"; i++) {}
+        if (i > NF || i > 5) next
+        stage = $1; for (j = 2; j < i - 1; j++) stage = stage " " $j
+        print config "\t" section " / " stage "\t" $(i - 1)
+      }' "$f"
+  done
+done | awk -F'\t' '
+  {
+    key = $2
+    if (!(key in order)) { order[key] = ++num_rows; rows[num_rows] = key }
+    if (!(($1, key) in best) || $3 < best[$1, key]) best[$1, key] = $3
+    if (!($1 in seen)) { seen[$1] = 1; configs[++num_configs] = $1 }
+  }
+  END {
+    printf "%-46s", "stage (ms, speedup)"
+    for (c = 1; c <= num_configs; c++) printf "%20s", configs[c]
+    printf "\n"
+    for (r = 1; r <= num_rows; r++) {
+      printf "%-46s", rows[r]
+      base = best[configs[1], rows[r]]
+      for (c = 1; c <= num_configs; c++) {
+        ms = best[configs[c], rows[r]]
+        printf "%12.1f %6.2fx", ms, (ms > 0 ? base / ms : 0)
+      }
+      printf "\n"
+    }
+  }'
@@ -0,0 +1,34 @@
+#!/bin/bash
+# Profile-guided build: builds instrumented tools, trains them on the
+# benchmark, the regression cases and (if given) a corpus of real clouds,
+# then rebuilds the same build directory optimized with the profiles.
+# Usage: _misc/pgo_build.sh [build_dir] [corpus_dir] [extra cmake args...]
+# The corpus is flattened into corpus_dir/flat_output; pass a copy.
+set -e
+root="$(cd "$(dirname "$0")/.." && pwd)"
+build="${1:-$root/_pgo_build}"
+corpus="$2"
+shift $(( $# < 2 ? $# : 2 ))
+profiles="$build/pgo-profiles"
+
+echo "== Instrumented build"
+rm -rf "$profiles"
+cmake -S "$root" -B "$build" "$@" -DFLATTEN_PGO=generate -DFLATTEN_PGO_DIR="$profiles" >/dev/null
+cmake --build "$build" -j"$(nproc)"
+tools="$(sed -n 's/^FLATTEN_TOOLS_DIR:PATH=//p' "$build/CMakeCache.txt")"
+
+echo "== Training"
+"$tools/bench_flatten" 2000000 >/dev/null
+"$build/regression_test" "$root/tests" >/dev/null
+if [ -n "$corpus" ]; then
+  if [ -x "$tools/new_flatten_pcl" ]; then
+    "$tools/new_flatten_pcl" "$corpus" --fresh >/dev/null
+  else
+    echo "new_flatten_pcl not built (no PCL): skipping the corpus"
+  fi
+fi
+
+echo "== Optimized build"
+cmake -S "$root" -B "$build" -DFLATTEN_PGO=use >/dev/null
+cmake --build "$build" -j"$(nproc)"
+ctest --test-dir "$build" --output-on-failure
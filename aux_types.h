@@ -1,6 +1,9 @@
 #ifndef AUX_TYPES_H
 #define AUX_TYPES_H
 
+#include <cstdint>
+#include <string>
+
 struct bbox {
   float minx, miny, maxx, maxy;
 };
@@ -10,4 +13,9 @@ struct lidar_point {
   int intensity;
 };
 
+struct input_file {
+  std::string path;
+  uintmax_t size; // bytes
+};
+
 #endif // AUX_TYPES_H
@@ -0,0 +1,439 @@
+
+/****************************************/
+/*     Flattening Stage Benchmarks      */
+/****************************************/
+
+// Runs the flattening stages on a synthetic scan-order cloud and reports
+// per-stage time, throughput and (where the kernel allows it) cache misses.
+// Usage: ./bench_flatten [num_points]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "aux_types.h"
+#include "dispatch.h"
+#include "grid.hpp"
+#include "util.h"
+#include "flatten.hpp"
+#include "morton.hpp"
+#include "parallel.hpp"
+#include "columnar.hpp"
+#include "ground_plane.hpp"
+#include "quantized.hpp"
+#include "world_ground.hpp"
+
+const float GRID_SIDE_LEN = 20;
+const int MIN_POINTS_PER_BLOCK = 100;
+const double COLUMNAR_PRECISION = 0.001;
+const float COMPACT_PRECISION = 0.001;
+
+// Same size and alignment as pcl::PointXYZI, which is what the tool works on
+struct alignas(16) padded_point {
+  float x, y, z, pad;
+  float intensity;
+  float pad2[3];
+};
+
+/****************************************/
+/*         Measurement Helpers          */
+/****************************************/
+
+/* Hardware cache-miss counter for the calling thread (reads -1 if unavailable) */
+class cache_miss_counter {
+
+  private:
+  int fd;
+
+  public:
+
+  cache_miss_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    this->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  ~cache_miss_counter() {
+    if (fd >= 0) close(fd);
+  }
+
+  void start() {
+    if (fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  long long stop() {
+    if (fd < 0) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+  }
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+double seconds_since(bench_clock::time_point start) {
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+std::string format_misses(long long misses) {
+  return (misses < 0) ? std::string("n/a") : format_number(misses);
+}
+
+/****************************************/
+/*        Synthetic Scan Cloud          */
+/****************************************/
+
+/* Points in scan order: a spinning sensor driving along a curved route over
+ * sloped terrain, so consecutive points jump between distant grid cells */
+void generate_scan_cloud(size_t num_points, std::vector<padded_point> &points) {
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> unit(0.0, 1.0);
+  std::normal_distribution<float> noise(0.0, 0.05);
+  const int POINTS_PER_SWEEP = 20000;
+  points.resize(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    float t = (float) i / num_points;
+    float sensor_x = 2000 * t;
+    float sensor_y = 200 * std::sin(3 * t);
+    float angle = 2 * M_PI * (i % POINTS_PER_SWEEP) / POINTS_PER_SWEEP;
+    float range = 2 + 80 * unit(rng);
+    float x = sensor_x + range * std::cos(angle);
+    float y = sensor_y + range * std::sin(angle);
+    float ground = 0.05 * x + 0.02 * y + 2 * std::sin(x / 50);
+    float z = ground + ((unit(rng) < 0.3) ? 5 * unit(rng) : noise(rng));
+    padded_point p = {};
+    p.x = x;
+    p.y = y;
+    p.z = z;
+    p.intensity = (int) (255 * unit(rng));
+    points[i] = p;
+  }
+}
+
+/****************************************/
+/*              Benchmarks              */
+/****************************************/
+
+void print_stage(std::string name, double secs, size_t num_points, long long misses) {
+  std::cout << "  " << std::left << std::setw(14) << name << std::right
+            << std::setw(9) << std::fixed << std::setprecision(1) << secs * 1000 << " ms"
+            << std::setw(9) << std::setprecision(1) << num_points / secs / 1e6 << " Mpts/s"
+            << std::setw(10) << format_misses(misses) << " misses" << std::endl;
+}
+
+/* Run bin, floor and adjust stages on a float copy, optionally after a Morton
+ * reorder, and write it back to the cloud as the tool does */
+void bench_pipeline(const std::vector<padded_point> &input, bool spatial_sort, int num_threads) {
+  std::cout << (spatial_sort ? "Morton order" : "Scan order")
+            << " (" << num_threads << " threads):" << std::endl;
+  cache_miss_counter counter;
+  size_t n = input.size();
+  bench_clock::time_point total_start = bench_clock::now();
+
+  grid pcl_grid(GRID_SIDE_LEN);
+  pcl_grid.compute_grid(compute_full_bbox(input));
+
+  std::vector<padded_point> points(n);
+  bench_clock::time_point start = bench_clock::now();
+  counter.start();
+  std::vector<uint32_t> order;
+  if (spatial_sort) {
+    morton_order(input, pcl_grid, order, num_threads);
+    for (size_t i = 0; i < n; i++) points[i] = input[order[i]];
+  } else {
+    points = input;
+  }
+  print_stage(spatial_sort ? "reorder" : "copy", seconds_since(start), n, counter.stop());
+
+  int num_cells = pcl_grid.h() * pcl_grid.w();
+  std::vector<uint32_t> cell_ids, cell_starts;
+  std::vector<float> cell_zs;
+  start = bench_clock::now();
+  counter.start();
+  compute_cell_ids(points, pcl_grid, cell_ids);
+  bin_zs(points, cell_ids, num_cells, cell_starts, cell_zs);
+  print_stage("bin", seconds_since(start), n, counter.stop());
+
+  std::vector<float> floor_zs;
+  start = bench_clock::now();
+  counter.start();
+  compute_floor_zs(cell_starts, cell_zs, MIN_POINTS_PER_BLOCK, floor_zs);
+  print_stage("floor", seconds_since(start), n, counter.stop());
+
+  start = bench_clock::now();
+  counter.start();
+  adjust_points(points, pcl_grid, floor_zs);
+  print_stage("adjust", seconds_since(start), n, counter.stop());
+
+  std::vector<padded_point> cloud(n);
+  start = bench_clock::now();
+  counter.start();
+  for (size_t i = 0; i < n; i++) cloud[spatial_sort ? order[i] : i] = points[i];
+  print_stage("write back", seconds_since(start), n, counter.stop());
+
+  print_stage("total", seconds_since(total_start), n, -1);
+}
+
+/* Same stages binning compact fixed-point copies, then adjusting the cloud
+ * in place in input order (COMPACT_POINTS), so there is no write-back */
+void bench_compact_pipeline(const std::vector<padded_point> &input, bool spatial_sort, int num_threads) {
+  std::cout << (spatial_sort ? "Morton order" : "Scan order") << ", compact points"
+            << " (" << num_threads << " threads):" << std::endl;
+  cache_miss_counter counter;
+  size_t n = input.size();
+  std::vector<padded_point> cloud = input; // the tool's cloud, adjusted in place
+  bench_clock::time_point total_start = bench_clock::now();
+
+  grid pcl_grid(GRID_SIDE_LEN);
+  pcl_grid.compute_grid(compute_full_bbox(cloud));
+  quantizer q(pcl_grid, COMPACT_PRECISION);
+
+  std::vector<compact_point> points(n);
+  std::vector<uint32_t> order;
+  bench_clock::time_point start = bench_clock::now();
+  counter.start();
+  if (spatial_sort) morton_order(cloud, pcl_grid, order, num_threads);
+  encode_points(cloud, spatial_sort ? order.data() : NULL, q, points);
+  print_stage(spatial_sort ? "reorder+enc" : "encode", seconds_since(start), n, counter.stop());
+
+  int num_cells = pcl_grid.h() * pcl_grid.w();
+  std::vector<uint32_t> cell_ids, cell_starts;
+  std::vector<float> cell_zs;
+  start = bench_clock::now();
+  counter.start();
+  compute_cell_ids(points, q, pcl_grid, cell_ids);
+  bin_zs(points, cell_ids, num_cells, cell_starts, cell_zs);
+  print_stage("bin", seconds_since(start), n, counter.stop());
+
+  std::vector<float> floor_zs;
+  start = bench_clock::now();
+  counter.start();
+  compute_floor_zs(cell_starts, cell_zs, MIN_POINTS_PER_BLOCK, floor_zs);
+  q.floor_units_to_metres(floor_zs);
+  print_stage("floor", seconds_since(start), n, counter.stop());
+
+  start = bench_clock::now();
+  counter.start();
+  adjust_points(cloud, pcl_grid, floor_zs);
+  print_stage("adjust", seconds_since(start), n, counter.stop());
+
+  print_stage("total", seconds_since(total_start), n, -1);
+}
+
+/* Ground stage cost: percentile height per cell vs robust plane per cell */
+void bench_ground_models(const std::vector<padded_point> &input, int num_threads) {
+  std::cout << "Ground models, Morton order (" << num_threads << " threads):" << std::endl;
+  size_t n = input.size();
+  grid pcl_grid(GRID_SIDE_LEN);
+  pcl_grid.compute_grid(compute_full_bbox(input));
+  int num_cells = pcl_grid.h() * pcl_grid.w();
+  std::vector<uint32_t> order;
+  morton_order(input, pcl_grid, order, num_threads);
+  std::vector<padded_point> points(n);
+  for (size_t i = 0; i < n; i++) points[i] = input[order[i]];
+  std::vector<uint32_t> cell_ids, cell_starts;
+  compute_cell_ids(points, pcl_grid, cell_ids);
+
+  std::vector<uint32_t> cell_points;
+  std::vector<float> cell_zs, floor_zs;
+  bench_clock::time_point start = bench_clock::now();
+  bin_zs(points, cell_ids, num_cells, cell_starts, cell_zs);
+  compute_floor_zs(cell_starts, cell_zs, MIN_POINTS_PER_BLOCK, floor_zs);
+  double percentile_secs = seconds_since(start);
+  print_stage("percentile", percentile_secs, n, -1);
+
+  std::vector<ground_plane> planes;
+  std::vector<plane_fit_buffers> buffers;
+  start = bench_clock::now();
+  bin_point_ids(cell_ids, num_cells, cell_starts, cell_points);
+  fit_ground_planes(points, cell_starts, cell_points, pcl_grid, MIN_POINTS_PER_BLOCK, num_threads, buffers, planes);
+  double plane_secs = seconds_since(start);
+  print_stage("plane", plane_secs, n, -1);
+  std::cout << "  plane / percentile: " << std::setprecision(2) << plane_secs / percentile_secs << "x" << std::endl;
+}
+
+/* Adjust stage only, in scan order: full slope correction vs height-only
+ * (the scalar policy and the vectorized in-place kernel) */
+void bench_adjust_modes(const std::vector<padded_point> &input) {
+  std::cout << "Adjust modes, scan order:" << std::endl;
+  size_t n = input.size();
+  grid pcl_grid(GRID_SIDE_LEN);
+  pcl_grid.compute_grid(compute_full_bbox(input));
+  int num_cells = pcl_grid.h() * pcl_grid.w();
+  std::vector<uint32_t> cell_ids, cell_starts;
+  std::vector<float> cell_zs, floor_zs, raster;
+  compute_cell_ids(input, pcl_grid, cell_ids);
+  bin_zs(input, cell_ids, num_cells, cell_starts, cell_zs);
+  compute_floor_zs(cell_starts, cell_zs, MIN_POINTS_PER_BLOCK, floor_zs);
+
+  std::vector<padded_point> full = input;
+  bench_clock::time_point start = bench_clock::now();
+  adjust_points<flatten_options<true, false> >(full, pcl_grid, floor_zs);
+  double full_secs = seconds_since(start);
+  print_stage("full", full_secs, n, -1);
+
+  std::vector<padded_point> scalar = input;
+  start = bench_clock::now();
+  adjust_points<flatten_options<false, false> >(scalar, pcl_grid, floor_zs);
+  print_stage("height scalar", seconds_since(start), n, -1);
+
+  std::vector<padded_point> kernel = input;
+  start = bench_clock::now();
+  subtract_floor_heights(kernel, pcl_grid, floor_zs, raster);
+  double kernel_secs = seconds_since(start);
+  print_stage("height kernel", kernel_secs, n, -1);
+
+  float max_diff = 0;
+  for (size_t i = 0; i < n; i++) max_diff = std::max(max_diff, std::fabs(kernel[i].z - scalar[i].z));
+  std::cout << "  full / height kernel: " << std::setprecision(2) << full_secs / kernel_secs
+            << "x, kernel vs scalar max |dz| " << std::scientific << max_diff << std::fixed << std::endl;
+}
+
+/* Frames per second over consecutive, overlapping frames of the cloud
+ * (frame_points each): a grid and ground per frame, as new_flatten_pcl
+ * flattens a batch, vs one world ground grid kept across them (--sequence) */
+void bench_sequence(const std::vector<padded_point> &input, size_t frame_points) {
+  size_t num_frames = input.size() / frame_points;
+  std::cout << "Sequence of " << num_frames << " frames of " << format_number(frame_points) << " points:"
+            << std::endl;
+  std::vector<std::vector<padded_point> > frames(num_frames);
+  for (size_t f = 0; f < num_frames; f++) {
+    frames[f].assign(input.begin() + f * frame_points, input.begin() + (f + 1) * frame_points);
+  }
+  auto print_fps = [&](std::string name, double secs) {
+    std::cout << "  " << std::left << std::setw(14) << name << std::right << std::fixed
+              << std::setw(8) << std::setprecision(1) << secs * 1e3 << " ms" << std::setw(10)
+              << num_frames / secs << " frames/s" << std::endl;
+  };
+
+  std::vector<std::vector<padded_point> > points = frames;
+  std::vector<uint32_t> cell_ids, cell_starts;
+  std::vector<float> cell_zs, floor_zs;
+  bench_clock::time_point start = bench_clock::now();
+  for (std::vector<padded_point> &frame : points) {
+    grid pcl_grid(GRID_SIDE_LEN);
+    pcl_grid.compute_grid(compute_full_bbox(frame));
+    compute_cell_ids(frame, pcl_grid, cell_ids);
+    bin_zs(frame, cell_ids, pcl_grid.h() * pcl_grid.w(), cell_starts, cell_zs);
+    compute_floor_zs(cell_starts, cell_zs, MIN_POINTS_PER_BLOCK, floor_zs);
+    adjust_points(frame, pcl_grid, floor_zs);
+  }
+  double per_frame_secs = seconds_since(start);
+  print_fps("per frame", per_frame_secs);
+
+  points = frames;
+  world_ground world(GRID_SIDE_LEN, MIN_POINTS_PER_BLOCK);
+  size_t floors_read = 0, floors_updated = 0, floors_saturated = 0;
+  start = bench_clock::now();
+  for (std::vector<padded_point> &frame : points) {
+    grid pcl_grid(GRID_SIDE_LEN);
+    world.align_grid(compute_points_bbox(frame), pcl_grid);
+    world.add_points(frame, pcl_grid);
+    world.floor_zs(pcl_grid, floor_zs);
+    adjust_points(frame, pcl_grid, floor_zs);
+    floors_read += pcl_grid.h() * pcl_grid.w();
+    floors_updated += world.num_floors_updated();
+    floors_saturated += world.num_floors_saturated();
+  }
+  double sequence_secs = seconds_since(start);
+  print_fps("world ground", sequence_secs);
+  std::cout << "  world / per frame: " << std::setprecision(2) << sequence_secs / per_frame_secs << "x, "
+            << floors_updated << " of " << floors_read << " floors re-read, " << floors_saturated
+            << " saturated" << std::endl;
+}
+
+/* Output size and write/read bandwidth: binary PCD layout vs .fcol */
+void bench_output(const std::vector<padded_point> &input, int num_threads) {
+  std::cout << "Output formats:" << std::endl;
+  size_t n = input.size();
+  grid pcl_grid(GRID_SIDE_LEN);
+  pcl_grid.compute_grid(compute_full_bbox(input));
+  std::vector<uint32_t> order;
+  morton_order(input, pcl_grid, order, num_threads);
+  std::string pcd_filename = "bench_output.pcd";
+  std::string fcol_filename = "bench_output.fcol";
+
+  // binary PCD body: x y z intensity as 4 floats per point
+  bench_clock::time_point start = bench_clock::now();
+  std::ofstream ofs(pcd_filename, std::ios_base::out | std::ios_base::binary);
+  for (padded_point const &p : input) {
+    float fields[4] = {p.x, p.y, p.z, p.intensity};
+    ofs.write((const char *) fields, sizeof(fields));
+  }
+  ofs.close();
+  double pcd_secs = seconds_since(start);
+  size_t pcd_bytes = n * 4 * sizeof(float);
+
+  start = bench_clock::now();
+  write_columnar(fcol_filename, input, &order, COLUMNAR_PRECISION);
+  double fcol_secs = seconds_since(start);
+  std::ifstream sized(fcol_filename, std::ios_base::binary | std::ios_base::ate);
+  size_t fcol_bytes = sized.tellg();
+
+  // decode a 100 m x 100 m region around the middle of the route
+  columnar_reader reader;
+  reader.open(fcol_filename);
+  padded_point const &mid = input[n / 2];
+  bbox region = bbox{mid.x - 50, mid.y - 50, mid.x + 50, mid.y + 50};
+  std::vector<lidar_point> region_points;
+  start = bench_clock::now();
+  int chunks_read = reader.read_region(region, region_points);
+  double region_secs = seconds_since(start);
+
+  std::cout << "  binary pcd    " << std::setw(9) << format_number(pcd_bytes) << "B  "
+            << std::setw(7) << std::setprecision(1) << pcd_bytes / pcd_secs / 1e6 << " MB/s" << std::endl;
+  std::cout << "  fcol          " << std::setw(9) << format_number(fcol_bytes) << "B  "
+            << std::setw(7) << std::setprecision(1) << pcd_bytes / fcol_secs / 1e6 << " MB/s (of pcd-equivalent)"
+            << "  ratio " << std::setprecision(2) << (double) pcd_bytes / fcol_bytes << "x" << std::endl;
+  std::cout << "  fcol region   " << chunks_read << "/" << reader.chunks().size() << " chunks, "
+            << format_number(region_points.size()) << " points in "
+            << std::setprecision(1) << region_secs * 1000 << " ms" << std::endl;
+  std::remove(pcd_filename.c_str());
+  std::remove(fcol_filename.c_str());
+}
+
+#ifndef FLATTEN_BUILD_CONFIG
+#define FLATTEN_BUILD_CONFIG "unknown"
+#endif
+
+int main(int argc, char **argv) {
+  size_t num_points = (argc > 1) ? std::strtoul(argv[1], NULL, 10) : 4000000;
+  std::cout << "Build: " << FLATTEN_BUILD_CONFIG << ", hot kernels: " << hot_kernel_isa() << std::endl;
+  std::cout << "Generating " << format_number(num_points) << " scan-order points..." << std::endl;
+  std::vector<padded_point> points;
+  generate_scan_cloud(num_points, points);
+
+  int num_threads = default_num_threads();
+  bench_pipeline(points, false, num_threads);
+  bench_pipeline(points, true, num_threads);
+  bench_compact_pipeline(points, false, num_threads);
+  bench_compact_pipeline(points, true, num_threads);
+  bench_ground_models(points, num_threads);
+  bench_adjust_modes(points);
+  bench_sequence(points, 20000);
+  bench_output(points, num_threads);
+  return 0;
+}
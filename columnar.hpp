@@ -0,0 +1,267 @@
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+
+#include <algorithm> // std::min, std::max
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "aux_types.h"
+#include "point_traits.hpp"
+
+/* Chunked columnar point format (.fcol) for flattened XYZI clouds
+ *
+ *   "FCOL" u32 version | f64 precision
+ *   chunk 0 | chunk 1 | ...
+ *   index: u32 num_chunks, then per chunk { u64 offset, u32 num_points, u32 num_bytes, bbox }
+ *   footer: u64 index offset, "FCOL"
+ *
+ * A chunk holds up to COLUMNAR_CHUNK_POINTS consecutive points as four
+ * columns (x, y, z, intensity), each prefixed with its u32 byte length
+ * (intensity is 0 for point types without one; other fields are not kept).
+ * Coordinates are rounded to multiples of precision; every column stores
+ * deltas from the previous point as zigzag varints. Writing points in
+ * spatial (e.g. Morton) order keeps the deltas small and chunk bboxes tight,
+ * so readers can decode only the chunks overlapping a query box. */
+
+const uint32_t COLUMNAR_VERSION = 1;
+const int COLUMNAR_CHUNK_POINTS = 16384;
+
+struct columnar_chunk {
+  uint64_t offset;
+  uint32_t num_points;
+  uint32_t num_bytes;
+  bbox box;
+};
+
+/****************************************/
+/*          Integer Encoding            */
+/****************************************/
+
+inline uint64_t zigzag_encode(int64_t v) {
+  return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t v) {
+  return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+inline void put_varint(std::string &buf, uint64_t v) {
+  while (v >= 0x80) {
+    buf.push_back((char) (v | 0x80));
+    v >>= 7;
+  }
+  buf.push_back((char) v);
+}
+
+/* Returns false if the varint runs past end */
+inline bool get_varint(const char *&p, const char *end, uint64_t *v) {
+  uint64_t result = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t byte = (uint8_t) *p++;
+    result |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *v = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename T>
+void put_raw(std::string &buf, T v) {
+  buf.append((const char *) &v, sizeof(T));
+}
+
+template <typename T>
+T get_raw(const char *p) {
+  T v;
+  memcpy(&v, p, sizeof(T));
+  return v;
+}
+
+/* Append a delta + zigzag varint column, prefixed with its byte length */
+inline void put_column(std::string &buf, const std::vector<int64_t> &values) {
+  std::string col;
+  int64_t prev = 0;
+  for (int64_t v : values) {
+    put_varint(col, zigzag_encode(v - prev));
+    prev = v;
+  }
+  put_raw<uint32_t>(buf, col.size());
+  buf += col;
+}
+
+/* Decode a column written by put_column; returns false on corrupt input */
+inline bool get_column(const char *&p, const char *end, size_t n, std::vector<int64_t> &values) {
+  if (end - p < 4) return false;
+  uint32_t num_bytes = get_raw<uint32_t>(p);
+  p += 4;
+  if ((size_t) (end - p) < num_bytes) return false;
+  const char *col_end = p + num_bytes;
+  values.resize(n);
+  int64_t prev = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint64_t v;
+    if (!get_varint(p, col_end, &v)) return false;
+    prev += zigzag_decode(v);
+    values[i] = prev;
+  }
+  p = col_end;
+  return true;
+}
+
+/****************************************/
+/*               Writer                 */
+/****************************************/
+
+/* Write points (in the given order, if any) as a .fcol file; returns false on I/O error */
+template <typename PointContainer>
+bool write_columnar(std::string filename, const PointContainer &points,
+                    const std::vector<uint32_t> *order, double precision) {
+  std::ofstream ofs(filename, std::ios_base::out | std::ios_base::binary);
+  if (!ofs) return false;
+  std::string buf;
+  buf += "FCOL";
+  put_raw<uint32_t>(buf, COLUMNAR_VERSION);
+  put_raw<double>(buf, precision);
+  uint64_t offset = buf.size();
+  ofs.write(buf.data(), buf.size());
+
+  std::vector<columnar_chunk> chunks;
+  std::vector<int64_t> xs, ys, zs, intensities;
+  size_t n = points.size();
+  for (size_t begin = 0; begin < n; begin += COLUMNAR_CHUNK_POINTS) {
+    size_t end = std::min(n, begin + COLUMNAR_CHUNK_POINTS);
+    columnar_chunk chunk;
+    chunk.offset = offset;
+    chunk.num_points = end - begin;
+    chunk.box = bbox{INFINITY, INFINITY, -INFINITY, -INFINITY};
+    xs.clear(); ys.clear(); zs.clear(); intensities.clear();
+    for (size_t i = begin; i < end; i++) {
+      typedef typename PointContainer::value_type PointT;
+      PointT const &p = points[order ? (*order)[i] : i];
+      xs.push_back(std::llround(p.x / precision));
+      ys.push_back(std::llround(p.y / precision));
+      zs.push_back(std::llround(p.z / precision));
+      intensities.push_back(std::llround(point_traits<PointT>::intensity(p)));
+      chunk.box.minx = std::min(chunk.box.minx, (float) (xs.back() * precision));
+      chunk.box.miny = std::min(chunk.box.miny, (float) (ys.back() * precision));
+      chunk.box.maxx = std::max(chunk.box.maxx, (float) (xs.back() * precision));
+      chunk.box.maxy = std::max(chunk.box.maxy, (float) (ys.back() * precision));
+    }
+    buf.clear();
+    put_column(buf, xs);
+    put_column(buf, ys);
+    put_column(buf, zs);
+    put_column(buf, intensities);
+    chunk.num_bytes = buf.size();
+    ofs.write(buf.data(), buf.size());
+    offset += buf.size();
+    chunks.push_back(chunk);
+  }
+
+  buf.clear();
+  put_raw<uint32_t>(buf, chunks.size());
+  for (columnar_chunk const &c : chunks) {
+    put_raw<uint64_t>(buf, c.offset);
+    put_raw<uint32_t>(buf, c.num_points);
+    put_raw<uint32_t>(buf, c.num_bytes);
+    put_raw<bbox>(buf, c.box);
+  }
+  put_raw<uint64_t>(buf, offset);
+  buf += "FCOL";
+  ofs.write(buf.data(), buf.size());
+  ofs.close();
+  return ofs.good();
+}
+
+/****************************************/
+/*               Reader                 */
+/****************************************/
+
+inline bool bbox_overlaps(const bbox &a, const bbox &b) {
+  return a.minx <= b.maxx && b.minx <= a.maxx && a.miny <= b.maxy && b.miny <= a.maxy;
+}
+
+/* Reads the chunk index of a .fcol file; decode only the chunks you need */
+class columnar_reader {
+
+  private:
+  std::ifstream ifs;
+  double step;
+  std::vector<columnar_chunk> index;
+  std::vector<int64_t> xs, ys, zs, intensities;
+
+  public:
+
+  /* Returns false if the file is missing or not a valid .fcol file */
+  bool open(std::string filename) {
+    ifs.open(filename, std::ios_base::in | std::ios_base::binary);
+    char head[16];
+    if (!ifs.read(head, 16) || memcmp(head, "FCOL", 4) != 0) return false;
+    if (get_raw<uint32_t>(head + 4) != COLUMNAR_VERSION) return false;
+    step = get_raw<double>(head + 8);
+    char foot[12];
+    if (!ifs.seekg(-12, std::ios_base::end) || !ifs.read(foot, 12)) return false;
+    if (memcmp(foot + 8, "FCOL", 4) != 0) return false;
+    ifs.seekg(get_raw<uint64_t>(foot));
+    char count[4];
+    if (!ifs.read(count, 4)) return false;
+    const size_t ENTRY_SIZE = 8 + 4 + 4 + sizeof(bbox);
+    std::vector<char> entries(get_raw<uint32_t>(count) * ENTRY_SIZE);
+    if (!ifs.read(entries.data(), entries.size())) return false;
+    index.resize(get_raw<uint32_t>(count));
+    for (size_t i = 0; i < index.size(); i++) {
+      const char *e = &entries[i * ENTRY_SIZE];
+      index[i].offset = get_raw<uint64_t>(e);
+      index[i].num_points = get_raw<uint32_t>(e + 8);
+      index[i].num_bytes = get_raw<uint32_t>(e + 12);
+      index[i].box = get_raw<bbox>(e + 16);
+    }
+    return true;
+  }
+
+  const std::vector<columnar_chunk> &chunks() {
+    return index;
+  }
+
+  double precision() {
+    return step;
+  }
+
+  /* Decode chunk i, appending its points to out; returns false on corrupt input */
+  bool read_chunk(size_t i, std::vector<lidar_point> &out) {
+    columnar_chunk const &c = index[i];
+    std::vector<char> buf(c.num_bytes);
+    ifs.clear();
+    if (!ifs.seekg(c.offset) || !ifs.read(buf.data(), buf.size())) return false;
+    const char *p = buf.data();
+    const char *end = p + buf.size();
+    if (!get_column(p, end, c.num_points, xs) || !get_column(p, end, c.num_points, ys)
+        || !get_column(p, end, c.num_points, zs) || !get_column(p, end, c.num_points, intensities)) {
+      return false;
+    }
+    for (size_t k = 0; k < c.num_points; k++) {
+      out.push_back(lidar_point{(float) (xs[k] * step), (float) (ys[k] * step),
+                                (float) (zs[k] * step), (int) intensities[k]});
+    }
+    return true;
+  }
+
+  /* Decode every chunk whose bbox overlaps query; returns the number of chunks read, or -1 */
+  int read_region(bbox query, std::vector<lidar_point> &out) {
+    int num_read = 0;
+    for (size_t i = 0; i < index.size(); i++) {
+      if (!bbox_overlaps(index[i].box, query)) continue;
+      if (!read_chunk(i, out)) return -1;
+      num_read++;
+    }
+    return num_read;
+  }
+};
+
+#endif // COLUMNAR_H
@@ -0,0 +1,37 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+/* Runtime CPU dispatch for the hot kernels. HOT_KERNEL compiles a function
+ * for the baseline x86-64 ISA and for AVX2 and AVX-512 (GCC function
+ * multiversioning); the loader picks the widest one the CPU supports, so a
+ * single portable binary uses the vector units of newer nodes too. Results
+ * do not depend on the version picked: the kernels fix their lane counts
+ * and the build disables FMA contraction (-ffp-contract=off).
+ * Define FLATTEN_NO_CLONES to build the baseline version only. */
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__) \
+    && !defined(FLATTEN_NO_CLONES)
+#define HOT_KERNEL __attribute__((target_clones("default", "avx2", "avx512f")))
+#define HOT_KERNEL_CLONES 1
+#else
+#define HOT_KERNEL
+#define HOT_KERNEL_CLONES 0
+#endif
+
+/* Instruction set the hot kernels run with on this CPU, for reports */
+inline const char *hot_kernel_isa() {
+#if HOT_KERNEL_CLONES
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return "avx512f";
+  if (__builtin_cpu_supports("avx2")) return "avx2";
+  return "default";
+#elif defined(__AVX512F__)
+  return "avx512f (compile time)";
+#elif defined(__AVX2__)
+  return "avx2 (compile time)";
+#else
+  return "default (compile time)";
+#endif
+}
+
+#endif // DISPATCH_H
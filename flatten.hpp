@@ -0,0 +1,283 @@
+#ifndef FLATTEN_H
+#define FLATTEN_H
+
+#include <algorithm> // std::nth_element
+#include <cmath>
+#include <cstdint>
+#include <utility> // std::pair
+#include <vector>
+
+#include "aux_types.h"
+#include "dispatch.h"
+#include "grid.hpp"
+#include "ground_labels.hpp"
+#include "util.h"
+
+/****************************************/
+/*   Flattening Stages (any point)      */
+/****************************************/
+
+/* Compile-time flattening options. Each combination instantiates its own
+ * copy of the stages, so the per-point loops carry no option checks. */
+template <bool AdjustSlope, bool Verbose>
+struct flatten_options {
+  static const bool adjust_slope = AdjustSlope; // level the floor's slope too, not only subtract its height
+  static const bool verbose = Verbose;          // print progress and the binned grid
+};
+
+typedef flatten_options<true, false> default_flatten_options;
+
+/* Compute bounding box (in x-y plane) around all points) */
+template <typename PointContainer>
+bbox compute_full_bbox(const PointContainer &points) {
+  float minx = 0.0;
+  float miny = 0.0;
+  float maxx = 0.0;
+  float maxy = 0.0;
+  for (auto const &p : points) {
+    if (p.x < minx) minx = p.x;
+    if (p.y < miny) miny = p.y;
+    if (p.x > maxx) maxx = p.x;
+    if (p.y > maxy) maxy = p.y;
+  }
+  return bbox{minx, miny, maxx, maxy};
+}
+
+/* Bounding box of the points alone; compute_full_bbox also spans the origin */
+template <typename PointContainer>
+bbox compute_points_bbox(const PointContainer &points) {
+  auto it = points.begin();
+  if (it == points.end()) return bbox{0, 0, 0, 0};
+  bbox b = {it->x, it->y, it->x, it->y};
+  for (; it != points.end(); ++it) {
+    if (it->x < b.minx) b.minx = it->x;
+    if (it->y < b.miny) b.miny = it->y;
+    if (it->x > b.maxx) b.maxx = it->x;
+    if (it->y > b.maxy) b.maxy = it->y;
+  }
+  return b;
+}
+
+/* Move a point onto a flat floor, given the floor height below it and the
+ * floor's angles of inclination there */
+template <typename PointT>
+void adjust_point_to_floor(PointT *p, float floor_z, float x_theta, float y_theta) {
+  p->z -= floor_z;
+  // transform the point so these angles become zero
+  //  - rotate by -x_theta about y axis
+  //  - rotate by -y_theta about x axis
+  // First x direction
+  float dx = -1.0 * p->z * std::tan(x_theta);
+  p->z = std::sqrt(p->z * p->z + dx * dx);
+  p->x -= dx;
+  // Then y direction
+  float dy = -1.0 * p->z * std::tan(y_theta);
+  p->z = std::sqrt(p->z * p->z + dy * dy);
+  p->y -= dy;
+}
+
+/* Adjust a point's position given the computed ground height */
+template <typename Options = default_flatten_options, typename PointT>
+void adjust_point(PointT *p, float bl_z, float br_z, float tl_z, float tr_z,
+                  float x_ratio, float y_ratio, float grid_scale) {
+  // interpolate floor z value
+  float floor_z = lerp_2d(bl_z, br_z, tl_z, tr_z, x_ratio, y_ratio);
+  if (!Options::adjust_slope) {
+    p->z -= floor_z;
+    return;
+  }
+  // interpolate x/y angles of inclination
+  float x_theta, y_theta;
+  interp_angles(bl_z, br_z, tl_z, tr_z, x_ratio, y_ratio, grid_scale, &x_theta, &y_theta);
+  adjust_point_to_floor(p, floor_z, x_theta, y_theta);
+}
+
+/* Grid cell of each point, as a row-major index y * w + x */
+template <typename PointContainer>
+HOT_KERNEL void compute_cell_ids(const PointContainer &points, grid &pcl_grid, std::vector<uint32_t> &cell_ids) {
+  cell_ids.resize(points.size());
+  for (size_t i = 0; i < points.size(); i++) {
+    std::pair<int, int> grid_indices = pcl_grid.to_indices(points[i].x, points[i].y);
+    int y_idx = int_clamp(grid_indices.first, 0, pcl_grid.h() - 1);
+    int x_idx = int_clamp(grid_indices.second, 0, pcl_grid.w() - 1);
+    cell_ids[i] = y_idx * pcl_grid.w() + x_idx;
+  }
+}
+
+/* Divide up the z's into grid blocks: one flat array grouped by cell
+ * (counting sort on cell id), so there is no per-cell allocation */
+template <typename PointContainer>
+void bin_zs(const PointContainer &points, const std::vector<uint32_t> &cell_ids, int num_cells,
+            std::vector<uint32_t> &cell_starts, std::vector<float> &cell_zs) {
+  cell_starts.assign(num_cells + 1, 0);
+  cell_zs.resize(points.size());
+  for (uint32_t c : cell_ids) {
+    cell_starts[c + 1]++;
+  }
+  for (int c = 0; c < num_cells; c++) {
+    cell_starts[c + 1] += cell_starts[c];
+  }
+  // fill using cell_starts[c] as a cursor, then shift the cursors back
+  for (size_t i = 0; i < points.size(); i++) {
+    cell_zs[cell_starts[cell_ids[i]]++] = points[i].z;
+  }
+  for (int c = num_cells; c > 0; c--) {
+    cell_starts[c] = cell_starts[c - 1];
+  }
+  cell_starts[0] = 0;
+}
+
+/* Compute floor z for each block as a low percentile of its z's */
+inline void compute_floor_zs(const std::vector<uint32_t> &cell_starts, std::vector<float> &cell_zs,
+                             unsigned int min_points_per_block, std::vector<float> &floor_zs) {
+  int num_cells = (int) cell_starts.size() - 1;
+  floor_zs.assign(num_cells, 0);
+  for (int c = 0; c < num_cells; c++) {
+    float *z_begin = cell_zs.data() + cell_starts[c];
+    float *z_end = cell_zs.data() + cell_starts[c + 1];
+    unsigned int num_zs = z_end - z_begin;
+    if (num_zs > min_points_per_block) { // skip sections with very few points
+      int k = num_zs/20; // <-- Parameter to be tuned!
+      std::nth_element(z_begin, z_begin + k, z_end);
+      floor_zs[c] = z_begin[k];
+    }
+  }
+}
+
+/* Adjust one point using the floor heights of the four grid cells around it */
+template <typename Options = default_flatten_options, typename PointT>
+void adjust_point_in_grid(PointT *p, grid &pcl_grid, const std::vector<float> &floor_zs) {
+  int w = pcl_grid.w();
+  std::pair<int, int> indices = pcl_grid.to_indices(p->x, p->y);
+  std::pair<float, float> center = pcl_grid.center_coords(indices.first, indices.second);
+  float dx_ratio = (p->x - center.first) / pcl_grid.s();
+  float dy_ratio = (p->y - center.second) / pcl_grid.s();
+  if (dy_ratio < 0) {
+    indices.first--;
+    dy_ratio += 1.0;
+  }
+  if (dx_ratio < 0) {
+    indices.second--;
+    dx_ratio += 1.0;
+  }
+  // get necessary values for four neighboring grid blocks
+  int y_bot = int_clamp(indices.first, 0, pcl_grid.h() - 1);
+  int y_top = int_clamp(indices.first + 1, 0, pcl_grid.h() - 1);
+  int x_left = int_clamp(indices.second, 0, pcl_grid.w() - 1);
+  int x_right = int_clamp(indices.second + 1, 0, pcl_grid.w() - 1);
+  float z_bl = floor_zs[y_bot * w + x_left];
+  float z_br = floor_zs[y_bot * w + x_right];
+  float z_tl = floor_zs[y_top * w + x_left];
+  float z_tr = floor_zs[y_top * w + x_right];
+  // Finally, adjust z value for this point
+  adjust_point<Options>(p, z_bl, z_br, z_tl, z_tr, dx_ratio, dy_ratio, pcl_grid.s());
+}
+
+/* Adjust each point based on floor height and angle with floor */
+template <typename Options = default_flatten_options, typename PointContainer>
+void adjust_points(PointContainer &points, grid &pcl_grid, const std::vector<float> &floor_zs) {
+  for (auto &p : points) {
+    adjust_point_in_grid<Options>(&p, pcl_grid, floor_zs);
+  }
+}
+
+/****************************************/
+/*        Height-Only Flattening        */
+/****************************************/
+
+const int HEIGHT_KERNEL_LANES = 8; // points per block in subtract_floor_heights
+
+/* Copy floor_zs into raster with a one-cell border repeating the edge cells,
+ * so the four cells around any point can be read without clamping */
+inline void pad_floor_raster(const std::vector<float> &floor_zs, int h, int w, std::vector<float> &raster) {
+  if (h <= 0 || w <= 0) { // no cells to repeat
+    raster.clear();
+    return;
+  }
+  raster.resize((h + 2) * (w + 2));
+  for (int y = 0; y < h + 2; y++) {
+    for (int x = 0; x < w + 2; x++) {
+      raster[y * (w + 2) + x] = floor_zs[int_clamp(y - 1, 0, h - 1) * w + int_clamp(x - 1, 0, w - 1)];
+    }
+  }
+}
+
+/* Padded raster column (or row) of the cell centre at or below a coordinate,
+ * and the ratio towards the next, computed with the same expressions as
+ * adjust_point_in_grid (grid::to_indices, grid::center_coords) so that the
+ * kernel's output is bit-identical to the scalar height-only pass. Uses only
+ * truncation, selects and clamps, so blocks of these vectorize. */
+inline void raster_position(float coord, float base, float s, int max_idx, int *idx, float *ratio) {
+  int i = (int) ((coord - base) / s);
+  float center = base + s * ((float) i + 0.5);
+  float r = (coord - center) / s;
+  bool below = (r < 0);
+  *idx = std::min(std::max(i - below + 1, 0), max_idx + 1);
+  *ratio = below ? (float) (r + 1.0) : r;
+}
+
+/* Subtract the bilinearly interpolated floor height from each point's z,
+ * reading the floor from raster (floor_zs of pcl_grid after pad_floor_raster).
+ * x, y and all other fields are left untouched, so points can be adjusted
+ * in place in the cloud. Points go through in blocks of HEIGHT_KERNEL_LANES:
+ * the coordinate and interpolation arithmetic runs across the block as
+ * vector code, and only the four raster reads per point are scalar.
+ * If labels is given (zeroed, ground_label_bytes(n) long), points left below
+ * label_height are labelled ground while still in registers. */
+template <typename PointContainer>
+HOT_KERNEL void subtract_raster_heights(PointContainer &points, grid &pcl_grid, const std::vector<float> &raster,
+                                        uint8_t *labels = NULL, float label_height = 0) {
+  const int L = HEIGHT_KERNEL_LANES;
+  int h = pcl_grid.h(), w = pcl_grid.w(), raster_w = w + 2;
+  if (raster.empty()) return; // empty grid
+  float base_x = pcl_grid.origin_x(), base_y = pcl_grid.origin_y(), s = pcl_grid.s();
+  const float *r = raster.data();
+  size_t n = points.size();
+  size_t i = 0;
+  for (; i + L <= n; i += L) {
+    int xi[L], yi[L];
+    float xr[L], yr[L], bl[L], br[L], tl[L], tr[L];
+    for (int j = 0; j < L; j++) {
+      raster_position(points[i + j].x, base_x, s, w - 1, &xi[j], &xr[j]);
+      raster_position(points[i + j].y, base_y, s, h - 1, &yi[j], &yr[j]);
+    }
+    for (int j = 0; j < L; j++) {
+      const float *cell = r + yi[j] * raster_w + xi[j];
+      bl[j] = cell[0];
+      br[j] = cell[1];
+      tl[j] = cell[raster_w];
+      tr[j] = cell[raster_w + 1];
+    }
+    for (int j = 0; j < L; j++) {
+      float bot = bl[j] * (1 - xr[j]) + br[j] * xr[j];
+      float top = tl[j] * (1 - xr[j]) + tr[j] * xr[j];
+      points[i + j].z -= bot * (1 - yr[j]) + top * yr[j];
+    }
+    if (labels) {
+      for (int j = 0; j < L; j++) {
+        if (points[i + j].z < label_height) set_ground_label(labels, i + j);
+      }
+    }
+  }
+  for (; i < n; i++) {
+    int xi, yi;
+    float xr, yr;
+    raster_position(points[i].x, base_x, s, w - 1, &xi, &xr);
+    raster_position(points[i].y, base_y, s, h - 1, &yi, &yr);
+    const float *cell = r + yi * raster_w + xi;
+    float bot = cell[0] * (1 - xr) + cell[1] * xr;
+    float top = cell[raster_w] * (1 - xr) + cell[raster_w + 1] * xr;
+    points[i].z -= bot * (1 - yr) + top * yr;
+    if (labels && points[i].z < label_height) set_ground_label(labels, i);
+  }
+}
+
+/* Same, padding floor_zs into raster first */
+template <typename PointContainer>
+void subtract_floor_heights(PointContainer &points, grid &pcl_grid, const std::vector<float> &floor_zs,
+                            std::vector<float> &raster, uint8_t *labels = NULL, float label_height = 0) {
+  pad_floor_raster(floor_zs, pcl_grid.h(), pcl_grid.w(), raster);
+  subtract_raster_heights(points, pcl_grid, raster, labels, label_height);
+}
+
+#endif // FLATTEN_H
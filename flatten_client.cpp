@@ -0,0 +1,59 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "server.hpp"
+
+/* Command line client for a running flattening server (new_flatten_pcl --serve) */
+
+void print_usage(char *prog) {
+  std::cout << "Usage: " << prog << " SOCKET flatten <input.pcd> <output.pcd> [--bbox minx,miny,maxx,maxy]"
+            << std::endl
+            << "       " << prog << " SOCKET stats" << std::endl
+            << "       " << prog << " SOCKET shutdown" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    print_usage(argv[0]);
+    return 2;
+  }
+  std::string command(argv[2]);
+  std::vector<std::string> fields(1, command);
+  if (command == "flatten" && (argc == 5 || (argc == 7 && std::string(argv[5]) == "--bbox"))) {
+    // the server has its own working directory
+    fields.push_back(boost::filesystem::absolute(argv[3]).string());
+    fields.push_back(boost::filesystem::absolute(argv[4]).string());
+    if (argc == 7) fields.push_back(argv[6]);
+  } else if ((command != "stats" && command != "shutdown") || argc != 3) {
+    print_usage(argv[0]);
+    return 2;
+  }
+  std::string request;
+  for (size_t i = 0; i < fields.size(); i++) {
+    request += (i ? "\t" : "") + fields[i];
+  }
+
+  int fd = connect_unix_socket(argv[1]);
+  if (fd < 0) {
+    std::cerr << "Couldn't connect to a server on " << argv[1] << std::endl;
+    return 1;
+  }
+  if (!write_all(fd, request + "\n")) {
+    std::cerr << "Couldn't send request" << std::endl;
+    close(fd);
+    return 1;
+  }
+  std::string reply;
+  char buf[4096];
+  for (ssize_t n; (n = read(fd, buf, sizeof(buf))) != 0; ) {
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) break;
+    reply.append(buf, n);
+  }
+  close(fd);
+  std::cout << reply << std::flush;
+  return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+}
@@ -14,6 +14,7 @@
 #include "grid.hpp"
 #include "aux_types.h"
 #include "util.h"
+#include "flatten.hpp"
 
 
 /* Read PCD to vector */
@@ -68,42 +69,8 @@ void write_pcd(std::string filename, std::vector<std::string> &headers, std::vec
   ofs.close();
 }
 
-/* Compute bounding box (in x-y plane) around all points) */
-bbox compute_full_bbox(std::vector<lidar_point> points) {
-  float minx = 0.0;
-  float miny = 0.0;
-  float maxx = 0.0;
-  float maxy = 0.0;
-  for (lidar_point p : points) {
-    if (p.x < minx) minx = p.x;
-    if (p.y < miny) miny = p.y;
-    if (p.x > maxx) maxx = p.x;
-    if (p.y > maxy) maxy = p.y;
-  }
-  return bbox{minx, miny, maxx, maxy};
-}
-
-
-void adjust_point(lidar_point *p, float bl_z, float br_z, float tl_z, float tr_z,
-                   float x_ratio, float y_ratio, float grid_scale) {
-  // interpolate floor z value
-  float floor_z = lerp_2d(bl_z, br_z, tl_z, tr_z, x_ratio, y_ratio);
-  p->z -= floor_z;
-  // interpolate x/y angles of inclination
-  float x_theta, y_theta;
-  interp_angles(bl_z, br_z, tl_z, tr_z, x_ratio, y_ratio, grid_scale, &x_theta, &y_theta);
-  // transform the point so these angles become zero
-  //  - rotate by -x_theta about y axis
-  //  - rotate by -y_theta about x axis
-  // First x direction
-  float dx = -1.0 * p->z * std::tan(x_theta);
-  p->z = std::sqrt(p->z * p->z + dx * dx);
-  p->x -= dx;
-  // Then y direction
-  float dy = -1.0 * p->z * std::tan(y_theta);
-  p->z = std::sqrt(p->z * p->z + dy * dy);
-  p->y -= dy;
-}
+// This tool always prints its progress and the binned grid
+typedef flatten_options<true, true> legacy_options;
 
 void flatten_pcd(std::string full_input_filename, std::string full_output_filename) {
   std::cout << std::endl << "Now flattening " << full_input_filename << "..." << std::endl;
@@ -124,20 +91,20 @@ void flatten_pcd(std::string full_input_filename, std::string full_output_filena
   float GRID_SIDE_LEN = 20;
   grid pcl_grid(GRID_SIDE_LEN);
   std::pair<int, int> grid_dim = pcl_grid.compute_grid(full_pcl_bbox);
+  int num_cells = grid_dim.first * grid_dim.second;
   
   // Divide up the z's into grid blocks
   std::cout << "Placing z's into grid blocks..." << std::endl;
-  std::vector< std::vector< std::vector<float> > > z_arrays(grid_dim.first,
-                std::vector< std::vector<float> >(grid_dim.second, std::vector<float>()));
-  for (lidar_point const &p : points) {
-    std::pair<int, int> grid_indices = pcl_grid.to_indices(p.x, p.y);
-    z_arrays[grid_indices.first][grid_indices.second].push_back(p.z);
-  }
+  std::vector<uint32_t> cell_ids, cell_starts;
+  std::vector<float> cell_zs;
+  compute_cell_ids(points, pcl_grid, cell_ids);
+  bin_zs(points, cell_ids, num_cells, cell_starts, cell_zs);
   // Debugging
   std::cout << "Grid blocks' sizes:" << std::endl;
   for (int col = 0; col < pcl_grid.h(); col++) {
     for (int row = 0; row < pcl_grid.w(); row++) {
-      std::cout << std::setw(8) << z_arrays[col][row].size() << " ";
+      int c = col * pcl_grid.w() + row;
+      std::cout << std::setw(8) << cell_starts[c + 1] - cell_starts[c] << " ";
     }
     std::cout << std::endl;
   }
@@ -145,53 +112,19 @@ void flatten_pcd(std::string full_input_filename, std::string full_output_filena
   // Compute floor z for each block
   std::cout << "Computing ground height per block..." << std::endl;
   const int MIN_POINTS_PER_BLOCK = 100;
-  std::vector< std::vector<float> > floor_zs(grid_dim.first,
-                std::vector<float>(grid_dim.second));
-  for (int y_idx = 0; y_idx < grid_dim.first; y_idx++) {
-    for (int x_idx = 0; x_idx < grid_dim.second; x_idx++) {
-      std::vector<float> z_vec = z_arrays[y_idx][x_idx];
-      if (z_vec.size() > MIN_POINTS_PER_BLOCK) { // skip sections with very few points
-        std::sort(z_vec.begin(), z_vec.end());
-        int k = z_vec.size()/20; // <-- Parameter to be tuned!
-        floor_zs[y_idx][x_idx] = z_vec[k];
-      }
-    }
-  }
+  std::vector<float> floor_zs;
+  compute_floor_zs(cell_starts, cell_zs, MIN_POINTS_PER_BLOCK, floor_zs);
   std::cout << "Ground zs:" << std::endl;
   for (int col = 0; col < pcl_grid.h(); col++) {
     for (int row = 0; row < pcl_grid.w(); row++) {
-      std::cout << std::setw(7) /*<< std::fixed*/ << std::setprecision(4) << floor_zs[col][row] << " ";
+      std::cout << std::setw(7) << std::setprecision(4) << floor_zs[col * pcl_grid.w() + row] << " ";
     }
     std::cout << std::endl;
   }
   
   // Adjust zs for each point
   std::cout << "Updating z values for all points..." << std::endl;
-  for (lidar_point &p : points) {
-    std::pair<int, int> indices = pcl_grid.to_indices(p.x, p.y);
-    std::pair<float, float> center = pcl_grid.center_coords(indices.first, indices.second);
-    float dx_ratio = (p.x - center.first) / GRID_SIDE_LEN;
-    float dy_ratio = (p.y - center.second) / GRID_SIDE_LEN;
-    if (dy_ratio < 0) {
-      indices.first--;
-      dy_ratio += 1.0;
-    }
-    if (dx_ratio < 0) {
-      indices.second--;
-      dx_ratio += 1.0;
-    }
-    // get necessary values for four neighboring grid blocks
-    int y_bot = int_clamp(indices.first, 0, pcl_grid.h() - 1);
-    int y_top = int_clamp(indices.first + 1, 0, pcl_grid.h() - 1);
-    int x_left = int_clamp(indices.second, 0, pcl_grid.w() - 1);
-    int x_right = int_clamp(indices.second + 1, 0, pcl_grid.w() - 1);
-    float z_bl = floor_zs[y_bot][x_left];
-    float z_br = floor_zs[y_bot][x_right];
-    float z_tl = floor_zs[y_top][x_left];
-    float z_tr = floor_zs[y_top][x_right];
-    // Finally, adjust z value for this point
-    adjust_point(&p, z_bl, z_br, z_tl, z_tr, dx_ratio, dy_ratio, pcl_grid.s());
-  }
+  adjust_points<legacy_options>(points, pcl_grid, floor_zs);
   std::cout << "Computations finished." << std::endl;
   
   // Rewrite pcd
@@ -13,8 +13,14 @@
 #include <cctype>
 #include <cstdio> // rename, sprintf
 #include <cstdlib>
+#include <cstring> // memcpy
 #include <utility> // std::pair
 #include <cmath>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <csignal>
 #include <boost/filesystem.hpp>
 
 // Pcl Library
@@ -26,73 +32,87 @@
 #include "grid.hpp"
 #include "aux_types.h"
 #include "util.h"
+#include "flatten.hpp"
+#include "morton.hpp"
+#include "parallel.hpp"
+#include "scratch_arena.hpp"
+#include "metrics.hpp"
+#include "columnar.hpp"
+#include "region.hpp"
+#include "ground_plane.hpp"
+#include "point_traits.hpp"
+#include "pcd_io.hpp"
+#include "journal.hpp"
+#include "supervisor.hpp"
+#include "ground_cache.hpp"
+#include "server.hpp"
+#include "pcd_stream.hpp"
+#include "world_ground.hpp"
+#include "ground_labels.hpp"
+#include "pipeline.hpp"
 
 const bool VERBOSE = false;
 
+// Files are flattened concurrently, so each thread collects a file's
+// messages and prints them in one piece once the file is done
+std::ostringstream &file_log() {
+  static thread_local std::ostringstream log;
+  return log;
+}
+
+void flush_file_log() {
+  static std::mutex print_mutex;
+  std::lock_guard<std::mutex> lock(print_mutex);
+  std::cout << file_log().str() << std::flush;
+  file_log().str("");
+}
+
 /****************************************/
 /*     PointCloud Helper Functions      */
 /****************************************/
 
-typedef pcl::PointXYZI PclPoint;
-typedef pcl::PointCloud<PclPoint> PclPointCloud;
+// Point types a file can be flattened as, picked from its FIELDS header
+// (pcl::PointXYZI uses the primary point_traits, via its intensity member)
+template <>
+struct point_traits<pcl::PointXYZ> {
+  static const int num_fields = 0;
+  static const char *field(int /* i */) { return ""; }
+  static bool packed(int /* i */) { return false; }
+  static void set_field(pcl::PointXYZ & /* p */, int /* i */, double /* v */) {}
+  static void set_packed_field(pcl::PointXYZ & /* p */, int /* i */, uint32_t /* bits */) {}
+  static float intensity(const pcl::PointXYZ & /* p */) { return 0; }
+};
 
-PclPointCloud::Ptr read_pcd(std::string input_filename) {
-  PclPointCloud::Ptr cloud(new PclPointCloud);
-  int result = pcl::io::loadPCDFile<PclPoint>(input_filename, *cloud);
+// packed float "rgb" field, as PCL writes it: 4 colour bytes, copied as is
+template <>
+struct point_traits<pcl::PointXYZRGB> {
+  static const int num_fields = 1;
+  static const char *field(int /* i */) { return "rgb"; }
+  static bool packed(int /* i */) { return true; }
+  static void set_field(pcl::PointXYZRGB & /* p */, int /* i */, double /* v */) {}
+  static void set_packed_field(pcl::PointXYZRGB &p, int /* i */, uint32_t bits) {
+    memcpy(&p.rgb, &bits, sizeof(bits));
+  }
+  static float intensity(const pcl::PointXYZRGB & /* p */) { return 0; }
+};
+
+/* Read into an existing cloud so its point buffer is reused across files */
+template <typename PointT>
+bool read_pcd(std::string input_filename, typename pcl::PointCloud<PointT>::Ptr cloud) {
+  int result = pcl::io::loadPCDFile<PointT>(input_filename, *cloud);
   if (result == -1) {
     PCL_ERROR(std::string(("Couldn't read file ") + input_filename).c_str());
-    return cloud;
+    return false;
   }
-  std::cout << "Loaded " << cloud->width * cloud->height
+  file_log() << "Loaded " << cloud->width * cloud->height
             << " points from " << input_filename << std::endl;
-  return cloud;
+  return true;
 }
 
-void write_pcd(std::string output_filename, PclPointCloud::Ptr cloud) {
+template <typename PointT>
+bool write_pcd(std::string output_filename, typename pcl::PointCloud<PointT>::Ptr cloud) {
   const bool binary_mode = true;
-  pcl::io::savePCDFile(output_filename, *cloud, binary_mode);
-}
-
-
-/****************************************/
-/*      Point-related Computations      */
-/****************************************/
-
-/* Compute bounding box (in x-y plane) around all points) */
-bbox compute_full_bbox(std::vector<PclPoint> points) {
-  float minx = 0.0;
-  float miny = 0.0;
-  float maxx = 0.0;
-  float maxy = 0.0;
-  for (PclPoint p : points) {
-    if (p.x < minx) minx = p.x;
-    if (p.y < miny) miny = p.y;
-    if (p.x > maxx) maxx = p.x;
-    if (p.y > maxy) maxy = p.y;
-  }
-  return bbox{minx, miny, maxx, maxy};
-}
-
-/* Adjust a point's position given the computed ground height */
-void adjust_point(PclPoint *p, float bl_z, float br_z, float tl_z, float tr_z,
-                   float x_ratio, float y_ratio, float grid_scale) {
-  // interpolate floor z value
-  float floor_z = lerp_2d(bl_z, br_z, tl_z, tr_z, x_ratio, y_ratio);
-  p->z -= floor_z;
-  // interpolate x/y angles of inclination
-  float x_theta, y_theta;
-  interp_angles(bl_z, br_z, tl_z, tr_z, x_ratio, y_ratio, grid_scale, &x_theta, &y_theta);
-  // transform the point so these angles become zero
-  //  - rotate by -x_theta about y axis
-  //  - rotate by -y_theta about x axis
-  // First x direction
-  float dx = -1.0 * p->z * std::tan(x_theta);
-  p->z = std::sqrt(p->z * p->z + dx * dx);
-  p->x -= dx;
-  // Then y direction
-  float dy = -1.0 * p->z * std::tan(y_theta);
-  p->z = std::sqrt(p->z * p->z + dy * dy);
-  p->y -= dy;
+  return pcl::io::savePCDFile(output_filename, *cloud, binary_mode) == 0;
 }
 
 
@@ -103,123 +123,738 @@ void adjust_point(PclPoint *p, float bl_z, float br_z, float tl_z, float tr_z,
 // Tunable parameters
 const float GRID_SIDE_LEN = 20;
 const int MIN_POINTS_PER_BLOCK = 100;
+const bool SPATIAL_SORT = false;       // process points in Morton order of grid cells (slower than scan
+                                        //   order in bench_flatten, before even restoring the order)
+const bool RESTORE_INPUT_ORDER = true; // write points back in their original order
+const int FILE_WORKERS = default_num_threads(); // files flattened at once, largest first; the
+                                                //   threads are split between them
+const bool PLANE_GROUND_MODEL = false; // robust plane per cell instead of a percentile height
+const bool COMPACT_POINTS = false;      // bin 12-byte fixed-point copies of the points instead of float
+                                        //   copies (percentile model; the cloud is adjusted in place)
+const float COMPACT_PRECISION = 0.001;  // metres per unit; floor heights are within half of this
+const bool ADJUST_SLOPE = true;         // level the floor's slope too; false only subtracts its height
+                                        //   (in place, with a vectorized kernel, for the percentile model)
+const bool COLUMNAR_OUTPUT = false;     // write compressed .fcol files instead of binary PCD
+const double COLUMNAR_PRECISION = 0.001; // metres; output coordinates are rounded to this
+const int GROUND_CACHE_ENTRIES = 256;   // ground rasters a server (--serve) keeps for re-flattened inputs
+const bool GROUND_LABELS = false;       // also write <output>.labels, a bitmask of the ground points
+const float GROUND_LABEL_HEIGHT = 0.2;  // metres; flattened points below this are labelled ground
+
+// Compile-time options the pipeline is instantiated with
+typedef flatten_options<ADJUST_SLOPE, VERBOSE> pipeline_options;
+
+// Run-time settings the pipeline (pipeline.hpp) is called with
+const pipeline_settings PIPELINE_SETTINGS = {MIN_POINTS_PER_BLOCK, SPATIAL_SORT,   RESTORE_INPUT_ORDER,
+                                             PLANE_GROUND_MODEL,   COMPACT_POINTS, COMPACT_PRECISION,
+                                             COLUMNAR_OUTPUT,      GROUND_LABEL_HEIGHT};
+
+// Journal key of a batch run: the output format and every setting above that
+// changes what is written, so a resumed run with other settings redoes its
+// inputs instead of skipping them (no spaces or newlines)
+std::string run_settings(std::string output_ext, std::string roi_arg) {
+  std::ostringstream oss;
+  oss << output_ext << ":grid=" << GRID_SIDE_LEN << ":min=" << MIN_POINTS_PER_BLOCK
+      << ":ground=" << (PLANE_GROUND_MODEL ? "plane" : "percentile") << ":slope=" << ADJUST_SLOPE
+      << ":order=" << (SPATIAL_SORT && !RESTORE_INPUT_ORDER ? "morton" : "input");
+  if (COMPACT_POINTS) oss << ":compact=" << COMPACT_PRECISION;
+  if (COLUMNAR_OUTPUT) oss << ":precision=" << COLUMNAR_PRECISION;
+  if (GROUND_LABELS) oss << ":labels=" << GROUND_LABEL_HEIGHT;
+  if (!roi_arg.empty()) oss << ":" << roi_arg;
+  return oss.str();
+}
 
-// Flatten function
-void flatten_pcd(std::string full_input_filename, std::string full_output_filename) {
-  std::cout << std::endl << "Now flattening " << full_input_filename << "..." << std::endl;
-  // Read pointcloud
-  PclPointCloud::Ptr cloud = read_pcd(full_input_filename);
-  // TODO find a better way to convert aligned vector to normal vector
-  std::vector<PclPoint> points;
-  for (unsigned int i = 0; i < cloud->points.size(); i++) {
-    points.push_back(cloud->points[i]);
+// State a worker keeps from one file to the next, per point type
+template <typename PointT>
+struct flatten_worker {
+  flatten_scratch<PointT> scratch;
+  typename pcl::PointCloud<PointT>::Ptr cloud;
+  int num_threads;  // for the parallel stages within a file
+  ground_cache *grounds; // shared ground rasters of a server, or NULL
+  world_ground *world;   // ground of the frames so far in sequence mode, or NULL
+  bool label_ground;     // fill scratch.labels while adjusting
+
+  flatten_worker()
+      : cloud(new pcl::PointCloud<PointT>), num_threads(1), grounds(NULL), world(NULL),
+        label_ground(GROUND_LABELS) {}
+};
+
+struct flatten_workers {
+  flatten_worker<pcl::PointXYZ> xyz;
+  flatten_worker<pcl::PointXYZI> xyzi;
+  flatten_worker<pcl::PointXYZRGB> xyzrgb;
+
+  void set_num_threads(int num_threads) {
+    xyz.num_threads = xyzi.num_threads = xyzrgb.num_threads = num_threads;
   }
-  
-  // Find bbox for complete pointcloud
-  bbox full_pcl_bbox = compute_full_bbox(points);
-  if (VERBOSE) std::cout << "Full pointcloud bbox: " << bbox_to_str(full_pcl_bbox) << std::endl;
 
-  // Create grid
+  void set_ground_cache(ground_cache *grounds) {
+    xyz.grounds = xyzi.grounds = xyzrgb.grounds = grounds;
+  }
+
+  void set_world_ground(world_ground *world) {
+    xyz.world = xyzi.world = xyzrgb.world = world;
+  }
+};
+
+// Read the points to flatten into cloud and set up the grid over them:
+// the whole file, or with a roi just the roi plus a one-cell halo read through
+// the file's chunk index (or cropped from the whole file, if it cannot be
+// indexed). Sets *num_roi_points to the number of leading points inside the
+// roi; returns false if the file cannot be read.
+template <typename PointT>
+bool load_points(std::string input_filename, const bbox *roi, typename pcl::PointCloud<PointT>::Ptr cloud,
+                 grid &pcl_grid, bbox *grid_box, size_t *num_roi_points) {
+  if (!roi) {
+    if (!read_pcd<PointT>(input_filename, cloud)) return false;
+    *grid_box = compute_full_bbox(cloud->points);
+    pcl_grid.compute_grid(*grid_box);
+    *num_roi_points = cloud->points.size();
+    return true;
+  }
+  pcd_index index;
+  if (!get_pcd_index(input_filename, index, file_log())) {
+    // e.g. binary_compressed data, which cannot be read by chunk
+    file_log() << "Couldn't index " << input_filename << " for region reads, reading all of it" << std::endl;
+    if (!read_pcd<PointT>(input_filename, cloud)) return false;
+    crop_region_points(cloud->points, *roi, compute_full_bbox(cloud->points), pcl_grid, grid_box, num_roi_points);
+    cloud->width = cloud->points.size();
+    cloud->height = 1;
+    return true;
+  }
+  int chunks_read = load_region_points(input_filename, index, *roi, pcl_grid, grid_box, cloud->points,
+                                       num_roi_points);
+  if (chunks_read < 0) {
+    file_log() << "Couldn't read region of " << input_filename << std::endl;
+    return false;
+  }
+  cloud->width = cloud->points.size();
+  cloud->height = 1;
+  file_log() << "Loaded " << cloud->points.size() << " points (" << chunks_read
+            << "/" << index.chunks.size() << " chunks) around " << bbox_to_str(*roi) << std::endl;
+  return true;
+}
+
+// Sidecar file of an output's ground labels
+std::string labels_filename(std::string output_filename) {
+  return output_filename + ".labels";
+}
+
+// Write the ground labels of the first num_points points of the cloud, in the
+// output's point order (point k is cloud point (*order)[k] if order is given)
+template <typename PointT>
+bool write_labels(std::string output_filename, size_t num_points, const std::vector<uint32_t> *order,
+                  flatten_scratch<PointT> &scratch) {
+  const uint8_t *labels = scratch.labels.data();
+  if (order) {
+    std::vector<uint8_t> &reordered = scratch.output_labels;
+    scratch.fit(reordered, ground_label_bytes(num_points));
+    reorder_ground_labels(labels, *order, num_points, reordered.data());
+    labels = reordered.data();
+  }
+  std::string filename = labels_filename(output_filename);
+  if (!write_ground_labels(partial_filename(filename), labels, num_points, GROUND_LABEL_HEIGHT)
+      || !commit_partial_file(filename)) {
+    std::remove(partial_filename(filename).c_str());
+    return false;
+  }
+  return true;
+}
+
+// Flatten function, instantiated per point type and options.
+// Returns true once the output is completely written under its final name.
+template <typename Options, typename PointT>
+bool flatten_pcd(std::string full_input_filename, std::string full_output_filename,
+                 const bbox *roi, flatten_worker<PointT> &worker) {
+  flatten_scratch<PointT> &scratch = worker.scratch;
+  scratch.begin_file();
+  file_timer timer;
+  timer.start();
+  // Read pointcloud and create grid
+  typename pcl::PointCloud<PointT>::Ptr cloud = worker.cloud;
   grid pcl_grid(GRID_SIDE_LEN);
-  std::pair<int, int> grid_dim = pcl_grid.compute_grid(full_pcl_bbox);
+  bbox full_pcl_bbox;
+  size_t num_output_points;
+  if (!load_points<PointT>(full_input_filename, roi, cloud, pcl_grid, &full_pcl_bbox, &num_output_points)) {
+    return false;
+  }
+  size_t num_points = cloud->points.size();
+  if (Options::verbose) file_log() << "Grid bbox: " << bbox_to_str(full_pcl_bbox) << std::endl;
+
+  // A server reuses the ground of an input it flattened before over the same grid
+  std::string ground_key;
+  std::shared_ptr<const ground_raster> ground;
+  if (worker.world) {
+    // In a sequence the ground is that of every frame so far, on the world
+    // grid laid over the frame's own points (not over the origin as well)
+    full_pcl_bbox = worker.world->align_grid(compute_points_bbox(cloud->points), pcl_grid);
+    worker.world->add_points(cloud->points, pcl_grid);
+    std::shared_ptr<ground_raster> frame_ground(new ground_raster);
+    worker.world->floor_zs(pcl_grid, frame_ground->floor_zs);
+    ground = frame_ground;
+    file_log() << "World ground: " << worker.world->num_cells() << " cells, "
+               << worker.world->num_floors_updated() << " of " << pcl_grid.h() * pcl_grid.w()
+               << " floors in this frame updated, " << worker.world->num_floors_saturated()
+               << " saturated" << std::endl;
+  } else if (worker.grounds) {
+    ground_key = ground_cache::key(full_input_filename, full_pcl_bbox);
+    ground = worker.grounds->find(ground_key);
+    if (ground && Options::verbose) file_log() << "Using cached ground raster" << std::endl;
+  }
+  bool cloud_in_morton_order = flatten_cloud<Options>(cloud->points, pcl_grid, ground.get(), worker.label_ground,
+                                                      scratch, PIPELINE_SETTINGS, worker.num_threads, file_log());
+  if (worker.grounds && !ground) {
+    std::shared_ptr<ground_raster> computed(new ground_raster);
+    computed->floor_zs = scratch.floor_zs;
+    if (PLANE_GROUND_MODEL) computed->planes = scratch.planes;
+    worker.grounds->insert(ground_key, computed);
+  }
   
-  // Divide up the z's into grid blocks
-  if (VERBOSE) std::cout << "Placing z's into grid blocks..." << std::endl;
-  std::vector< std::vector< std::vector<float> > > z_arrays(grid_dim.first,
-                std::vector< std::vector<float> >(grid_dim.second, std::vector<float>()));
-  for (PclPoint const &p : points) {
-    std::pair<int, int> grid_indices = pcl_grid.to_indices(p.x, p.y);
-    z_arrays[grid_indices.first][grid_indices.second].push_back(p.z);
-  }
-  if (VERBOSE) {
-    std::cout << "Grid blocks' sizes:" << std::endl;
-    for (int col = 0; col < pcl_grid.h(); col++) {
-      for (int row = 0; row < pcl_grid.w(); row++) {
-        std::cout << std::setw(8) << z_arrays[col][row].size() << " ";
+  // Drop the halo points of a region read: the input points past num_output_points
+  if (num_output_points < num_points) {
+    if (cloud_in_morton_order) {
+      // point i is input point order[i], so keep the roi points (and their labels) in place
+      std::vector<uint32_t> &order = scratch.order;
+      uint8_t *labels = worker.label_ground ? scratch.labels.data() : NULL;
+      size_t k = 0;
+      for (size_t i = 0; i < num_points; i++) {
+        if (order[i] >= num_output_points) continue;
+        cloud->points[k] = cloud->points[i];
+        if (labels) {
+          bool ground = ground_label(labels, i);
+          labels[k >> 3] &= (uint8_t) ~(1 << (k & 7));
+          if (ground) set_ground_label(labels, k);
+        }
+        order[k++] = order[i];
       }
-      std::cout << std::endl;
+      order.resize(k);
     }
+    cloud->points.resize(num_output_points);
+    cloud->width = num_output_points;
+    cloud->height = 1;
+    if (COLUMNAR_OUTPUT && !cloud_in_morton_order) {
+      std::vector<uint32_t> &order = scratch.order;
+      order.erase(std::remove_if(order.begin(), order.end(),
+                                 [num_output_points](uint32_t i) { return i >= num_output_points; }),
+                  order.end());
+    }
+  }
+
+  // Ground labels go first, so a complete output always has its labels
+  if (worker.label_ground && !write_labels<PointT>(full_output_filename, num_output_points,
+                                                   (COLUMNAR_OUTPUT && !cloud_in_morton_order) ? &scratch.order : NULL,
+                                                   scratch)) {
+    file_log() << "Couldn't write " << labels_filename(full_output_filename) << std::endl;
+    return false;
+  }
+
+  // Rewrite pcd, to a partial file that only replaces the output once complete
+  file_log() << "Computations finished, writing output to "
+            << full_output_filename << "..." << std::endl;
+  std::string partial = partial_filename(full_output_filename);
+  bool written;
+  if (COLUMNAR_OUTPUT) {
+    written = write_columnar(partial, cloud->points, cloud_in_morton_order ? NULL : &scratch.order,
+                             COLUMNAR_PRECISION);
+  } else {
+    written = write_pcd<PointT>(partial, cloud);
+  }
+  if (!written || !commit_partial_file(full_output_filename)) {
+    file_log() << "Couldn't write " << full_output_filename << std::endl;
+    std::remove(partial.c_str());
+    return false;
+  }
+  file_metrics metrics;
+  metrics.num_points = num_points;
+  metrics.scratch_allocations = scratch.allocations;
+  metrics.scratch_bytes = scratch.bytes_reserved();
+  timer.stop(&metrics);
+  file_log() << "Metrics: " << metrics_to_str(metrics) << std::endl;
+  if (Options::verbose) file_log() << "Done." << std::endl << std::endl;
+  return true;
+}
+
+// Pick the point type from the file's FIELDS header, once per file.
+// Returns true if the output was written.
+bool flatten_file(std::string full_input_filename, std::string full_output_filename,
+                  const bbox *roi, flatten_workers &workers) {
+  file_log() << std::endl << "Now flattening " << full_input_filename << "..." << std::endl;
+  std::ifstream ifs(full_input_filename, std::ios_base::in | std::ios_base::binary);
+  pcd_header h;
+  if (!ifs || !read_pcd_header(ifs, h)) {
+    file_log() << "Couldn't read PCD header of " << full_input_filename << std::endl;
+    return false;
+  }
+  ifs.close();
+  // intensity first, the field the columnar output keeps (rgb is dropped from files with both)
+  if (pcd_has_fields<pcl::PointXYZI>(h)) {
+    return flatten_pcd<pipeline_options>(full_input_filename, full_output_filename, roi, workers.xyzi);
+  } else if (pcd_has_fields<pcl::PointXYZRGB>(h)) {
+    return flatten_pcd<pipeline_options>(full_input_filename, full_output_filename, roi, workers.xyzrgb);
+  } else if (pcd_has_fields<pcl::PointXYZ>(h)) {
+    return flatten_pcd<pipeline_options>(full_input_filename, full_output_filename, roi, workers.xyz);
+  }
+  file_log() << "No x/y/z fields in " << full_input_filename << ", skipping" << std::endl;
+  return false;
+}
+
+/* Flatten each file in its own supervised process (see supervisor.hpp),
+ * journaling files given up on as quarantined, and print one summary of
+ * the batch. Returns the exit code: nonzero if any file was not done. */
+int supervise_files(const std::vector<input_file> &input_files, const std::vector<std::string> &output_filenames,
+                    const bbox *roi, const supervisor_limits &limits, run_journal &journal, std::string settings) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  flatten_workers worker;
+  worker.set_num_threads(std::max(1, default_num_threads() / limits.num_procs));
+  std::vector<job_report> given_up;
+  size_t num_finished = 0, num_done = 0, num_retried = 0;
+  supervise(input_files.size(), limits,
+    [&](size_t i) {
+      // in the job process; the journal's appends are atomic across processes
+      bool ok = flatten_file(input_files[i].path, output_filenames[i], roi, worker);
+      if (ok && !journal.record(run_journal::entry(input_files[i], settings))) {
+        file_log() << "Couldn't journal " << input_files[i].path << std::endl;
+      }
+      flush_file_log();
+      return ok;
+    },
+    [&](const job_report &r) {
+      num_finished++;
+      if (r.attempts > 1) num_retried++;
+      if (r.outcome == JOB_DONE) {
+        num_done++;
+      } else {
+        given_up.push_back(r);
+        journal.record(run_journal::entry(input_files[r.job], settings, "quarantined"));
+      }
+      std::cout << "[" << num_finished << "/" << input_files.size() << "] " << job_outcome_str(r.outcome)
+                << ": " << input_files[r.job].path << " (" << r.seconds << " s";
+      if (r.attempts > 1) std::cout << ", attempt " << r.attempts;
+      std::cout << ")" << std::endl;
+    });
+
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << std::endl << "Summary: " << num_done << " of " << input_files.size() << " files done, "
+            << num_retried << " retried, " << given_up.size() << " quarantined (" << secs << " s)" << std::endl;
+  for (job_report const &r : given_up) {
+    std::cout << "  " << job_outcome_str(r.outcome) << " after " << r.attempts << " attempt"
+              << (r.attempts > 1 ? "s" : "") << ": " << input_files[r.job].path << std::endl;
+  }
+  if (!given_up.empty()) {
+    std::cout << "Quarantined files are skipped by later runs until they change (or --fresh)" << std::endl;
+  }
+  return given_up.empty() ? 0 : 1;
+}
+
+/****************************************/
+/*             Server Mode              */
+/****************************************/
+
+double ms_since(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count();
+}
+
+// Flatten one request on a server worker and reply with the outcome and the file's log
+void serve_flatten(server_request &r, flatten_workers &workers, server_stats &stats) {
+  double wait = ms_since(r.arrival);
+  stats.job_started();
+  bbox roi;
+  bool use_roi = r.fields.size() > 3 && !r.fields[3].empty();
+  bool ok;
+  if (use_roi && !parse_bbox(r.fields[3], &roi)) {
+    file_log() << "Bad bbox " << r.fields[3] << std::endl;
+    ok = false;
+  } else {
+    ok = flatten_file(r.fields[1], r.fields[2], use_roi ? &roi : NULL, workers);
+  }
+  std::string log = file_log().str();
+  flush_file_log();
+  double total = ms_since(r.arrival);
+  stats.job_finished(ok, wait, total);
+  std::ostringstream reply;
+  reply << (ok ? "ok" : "error") << "\t" << (long) total << " ms\n" << log;
+  write_all(r.fd, reply.str());
+  close(r.fd);
+}
+
+/* Answer a request on a worker. Returns true if it asked the server to
+ * shut down. */
+bool serve_connection(server_request &r, flatten_workers &workers, server_stats &stats, ground_cache &grounds,
+                      request_queue &requests, int num_workers) {
+  if (r.fields[0] == "flatten" && r.fields.size() >= 3) {
+    serve_flatten(r, workers, stats);
+    return false;
+  }
+  bool shutdown = false;
+  if (r.fields[0] == "stats") {
+    size_t entries, hits, misses;
+    grounds.stats(&entries, &hits, &misses);
+    std::ostringstream reply;
+    reply << "ok\n" << stats.report(requests.size(), num_workers)
+          << "ground_cache entries " << entries << " hits " << hits << " misses " << misses << "\n";
+    write_all(r.fd, reply.str());
+  } else if (r.fields[0] == "shutdown") {
+    write_all(r.fd, "ok\tshutting down once queued jobs finish\n");
+    shutdown = true;
+  } else {
+    write_all(r.fd, "error\tunknown request " + r.fields[0] + "\n");
   }
+  close(r.fd);
+  return shutdown;
+}
+
+/* Long-running server: accept requests on a Unix socket (see server.hpp)
+ * and serve them on num_workers threads, whose arenas, clouds and ground
+ * cache stay warm between requests. Runs until a shutdown request. */
+int serve(std::string socket_path, int num_workers) {
+  int listen_fd = listen_unix_socket(socket_path);
+  if (listen_fd < 0) {
+    std::cout << "Couldn't listen on " << socket_path << " (in use?)" << std::endl;
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN); // a client that hung up only fails its own reply
+  ground_cache grounds(GROUND_CACHE_ENTRIES);
+  request_queue requests;
+  server_stats stats;
+  std::vector<flatten_workers> workers(num_workers);
+  std::atomic<bool> stopping(false);
+  std::cout << "Serving on " << socket_path << " with " << num_workers << " workers" << std::endl;
 
-  // Compute floor z for each block
-  if (VERBOSE) std::cout << "Computing ground height per block..." << std::endl;
-  std::vector< std::vector<float> > floor_zs(grid_dim.first,
-                std::vector<float>(grid_dim.second));
-  for (int y_idx = 0; y_idx < grid_dim.first; y_idx++) {
-    for (int x_idx = 0; x_idx < grid_dim.second; x_idx++) {
-      std::vector<float> z_vec = z_arrays[y_idx][x_idx];
-      if (z_vec.size() > MIN_POINTS_PER_BLOCK) { // skip sections with very few points
-        std::sort(z_vec.begin(), z_vec.end());
-        int k = z_vec.size()/20; // <-- Parameter to be tuned!
-        floor_zs[y_idx][x_idx] = z_vec[k];
+  run_on_threads(num_workers + 1, [&](int t) {
+    if (t > 0) {
+      flatten_workers &w = workers[t - 1];
+      w.set_num_threads(std::max(1, default_num_threads() / num_workers));
+      w.set_ground_cache(&grounds);
+      server_request r;
+      while (requests.pop(&r)) {
+        if (serve_connection(r, w, stats, grounds, requests, num_workers) && !stopping.exchange(true)) {
+          shutdown(listen_fd, SHUT_RDWR); // wakes the accept below
+        }
+      }
+      return;
+    }
+    // Thread 0 accepts connections and reads their request lines as they
+    // arrive (see request_reader), so a slow client holds up neither the
+    // next one nor a worker; workers only get whole requests
+    request_reader reader;
+    std::vector<server_request> ready;
+    for (;;) {
+      ready.clear();
+      short events = reader.poll_once(listen_fd, ready);
+      for (server_request const &r : ready) requests.push(r);
+      if (!events) continue;
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd < 0) {
+        if (!stopping && (errno == EINTR || errno == ECONNABORTED)) continue;
+        break;
       }
+      reader.add(fd);
     }
+    requests.close();
+  });
+  close(listen_fd);
+  unlink(socket_path.c_str());
+  std::cout << "Server stopped" << std::endl;
+  return 0;
+}
+
+/****************************************/
+/*              Pipe Mode               */
+/****************************************/
+
+const size_t PIPE_BATCH_POINTS = 65536; // records streamed at a time against a ground raster (a
+                                        //   multiple of 8, so a batch's labels are whole bytes)
+
+/* Flatten a PCD from stdin to stdout, in the input's format, with every field
+ * but x, y, z passed through as read. Against a ground raster the points
+ * stream through in batches, in bounded memory; otherwise the cloud is
+ * buffered once to compute its ground, which can be saved for later runs.
+ * Ground labels, if asked for, are written by record (streamed by batch
+ * against a raster). Messages go to stderr. */
+int flatten_pipe(std::string ground_filename, std::string save_ground_filename, std::string labels_filename) {
+  std::ios_base::sync_with_stdio(false);
+  pcd_header h;
+  pcd_record_buffer records;
+  if (!read_pcd_header(std::cin, h) || !records.init(h)) {
+    std::cerr << "Expected an ascii or binary PCD with x, y, z fields on stdin" << std::endl;
+    return 1;
   }
-  if (VERBOSE) {
-    std::cout << "Ground zs:" << std::endl;
-    for (int col = 0; col < pcl_grid.h(); col++) {
-      for (int row = 0; row < pcl_grid.w(); row++) {
-        std::cout << std::setw(7) << std::setprecision(4) << floor_zs[col][row] << " ";
+  grid pcl_grid(GRID_SIDE_LEN);
+  size_t num_written = 0;
+  bool label_ground = !labels_filename.empty();
+  if (!ground_filename.empty()) {
+    std::vector<float> floor_zs;
+    if (!read_ground_raster(ground_filename, pcl_grid, floor_zs)) {
+      std::cerr << "Couldn't read ground raster " << ground_filename << std::endl;
+      return 1;
+    }
+    // Same passes as file mode, by batch (see flatten_batch)
+    std::vector<float> raster;
+    if (!pipeline_options::adjust_slope) pad_floor_raster(floor_zs, pcl_grid.h(), pcl_grid.w(), raster);
+    std::vector<lidar_point> batch;
+    std::vector<uint8_t> batch_labels;
+    // The point count is known from the header, so the labels stream out by batch too
+    std::ofstream labels_out;
+    if (label_ground) {
+      labels_out.open(labels_filename, std::ios_base::out | std::ios_base::binary);
+      write_ground_labels_header(labels_out, h.points, GROUND_LABEL_HEIGHT);
+    }
+    write_pcd_header(std::cout, h);
+    while (num_written < h.points
+           && records.read(std::cin, std::min(PIPE_BATCH_POINTS, h.points - num_written)) > 0) {
+      batch.resize(records.size());
+      for (size_t k = 0; k < records.size(); k++) batch[k] = records.point(k);
+      uint8_t *batch_mask = NULL;
+      if (label_ground) {
+        batch_labels.assign(ground_label_bytes(batch.size()), 0);
+        batch_mask = batch_labels.data();
       }
-      std::cout << std::endl;
+      flatten_batch<pipeline_options>(batch, pcl_grid, floor_zs, raster, batch_mask, GROUND_LABEL_HEIGHT);
+      for (size_t k = 0; k < records.size(); k++) records.set_point(k, batch[k]);
+      if (label_ground) write_ground_label_bytes(labels_out, batch_mask, batch.size());
+      records.write(std::cout);
+      num_written += records.size();
+      records.clear();
+    }
+    if (label_ground) {
+      labels_out.close();
+      if (num_written < h.points) std::remove(labels_filename.c_str()); // would not match its header
+      if (!labels_out) {
+        std::cerr << "Couldn't write ground labels " << labels_filename << std::endl;
+        return 1;
+      }
+    }
+  } else {
+    // Only x, y, z are decoded; the records keep the rest
+    records.read(std::cin, h.points);
+    flatten_worker<pcl::PointXYZ> worker;
+    worker.num_threads = default_num_threads();
+    worker.label_ground = label_ground;
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud = worker.cloud;
+    cloud->points.resize(records.size());
+    cloud->width = records.size();
+    cloud->height = 1;
+    for (size_t k = 0; k < records.size(); k++) {
+      lidar_point p = records.point(k);
+      cloud->points[k].x = p.x;
+      cloud->points[k].y = p.y;
+      cloud->points[k].z = p.z;
+    }
+    bbox grid_box = compute_full_bbox(cloud->points);
+    pcl_grid.compute_grid(grid_box);
+    bool morton = flatten_cloud<pipeline_options>(cloud->points, pcl_grid, NULL, worker.label_ground, worker.scratch,
+                                                  PIPELINE_SETTINGS, worker.num_threads, file_log());
+    std::vector<uint8_t> labels; // by record
+    if (label_ground) labels.assign(ground_label_bytes(records.size()), 0);
+    for (size_t k = 0; k < records.size(); k++) {
+      pcl::PointXYZ const &q = cloud->points[k];
+      lidar_point p = {q.x, q.y, q.z, 0};
+      size_t record = morton ? worker.scratch.order[k] : k;
+      records.set_point(record, p);
+      if (label_ground && ground_label(worker.scratch.labels.data(), k)) set_ground_label(labels.data(), record);
+    }
+    if (!save_ground_filename.empty() && !write_ground_raster(save_ground_filename, pcl_grid,
+                                                              worker.scratch.floor_zs)) {
+      std::cerr << "Couldn't write ground raster " << save_ground_filename << std::endl;
+      return 1;
+    }
+    write_pcd_header(std::cout, h);
+    records.write(std::cout);
+    num_written = records.size();
+    if (label_ground && !write_ground_labels(labels_filename, labels.data(), num_written, GROUND_LABEL_HEIGHT)) {
+      std::cerr << "Couldn't write ground labels " << labels_filename << std::endl;
+      return 1;
     }
   }
-  
-  // Adjust each point based on floor height and angle with floor
-  if (VERBOSE) std::cout << "Adjusting all points..." << std::endl;
-  for (PclPoint &p : points) {
-    std::pair<int, int> indices = pcl_grid.to_indices(p.x, p.y);
-    std::pair<float, float> center = pcl_grid.center_coords(indices.first, indices.second);
-    float dx_ratio = (p.x - center.first) / GRID_SIDE_LEN;
-    float dy_ratio = (p.y - center.second) / GRID_SIDE_LEN;
-    if (dy_ratio < 0) {
-      indices.first--;
-      dy_ratio += 1.0;
-    }
-    if (dx_ratio < 0) {
-      indices.second--;
-      dx_ratio += 1.0;
-    }
-    // get necessary values for four neighboring grid blocks
-    int y_bot = int_clamp(indices.first, 0, pcl_grid.h() - 1);
-    int y_top = int_clamp(indices.first + 1, 0, pcl_grid.h() - 1);
-    int x_left = int_clamp(indices.second, 0, pcl_grid.w() - 1);
-    int x_right = int_clamp(indices.second + 1, 0, pcl_grid.w() - 1);
-    float z_bl = floor_zs[y_bot][x_left];
-    float z_br = floor_zs[y_bot][x_right];
-    float z_tl = floor_zs[y_top][x_left];
-    float z_tr = floor_zs[y_top][x_right];
-    // Finally, adjust z value for this point
-    adjust_point(&p, z_bl, z_br, z_tl, z_tr, dx_ratio, dy_ratio, pcl_grid.s());
+  std::cerr << file_log().str();
+  std::cout.flush();
+  if (num_written < h.points) {
+    std::cerr << "Input ended after " << num_written << " of " << h.points << " points" << std::endl;
+    return 1;
   }
-  
-  // Write points back to cloud->points vector
-  for (unsigned int i = 0; i < cloud->points.size(); i++) {
-    cloud->points[i] = points[i];
+  if (!std::cout) {
+    std::cerr << "Couldn't write to stdout" << std::endl;
+    return 1;
   }
-  
-  // Rewrite pcd
-  std::cout << "Computations finished, writing output to "
-            << full_output_filename << "..." << std::endl;
-  write_pcd(full_output_filename, cloud);
-  if (VERBOSE) std::cout << "Done." << std::endl << std::endl;
+  return 0;
+}
+
+void print_usage(char *prog) {
+  std::cout << "Usage: " << prog << " <input_directory> [--bbox minx,miny,maxx,maxy]"
+            << " [--include GLOB]... [--exclude GLOB]... [--fresh]" << std::endl
+            << "       [--isolate [--max-memory MB] [--timeout SECS] [--attempts N]] [--sequence]" << std::endl
+            << "  GLOBs match file names, e.g. --include 'tile_*' --exclude '*_old.pcd'" << std::endl
+            << "  Finished files are journaled and skipped by the next run; --fresh redoes them" << std::endl
+            << "  --isolate flattens each file in its own process, retrying crashed, out of" << std::endl
+            << "  memory and timed out files up to N times before quarantining them" << std::endl
+            << "  --sequence flattens overlapping frames in name order against one ground grid" << std::endl
+            << "   or: " << prog << " --serve SOCKET" << std::endl
+            << "  Serves flatten requests on a Unix socket; see flatten_client" << std::endl
+            << "   or: " << prog << " --pipe [--ground RASTER | --save-ground RASTER] [--labels FILE]"
+            << " < in.pcd > out.pcd" << std::endl
+            << "  Flattens one ascii or binary PCD from stdin to stdout, streaming against a saved" << std::endl
+            << "  ground raster if given; --labels also writes the ground label bitmask" << std::endl;
 }
 
 int main(int argc, char **argv) {
   // Parse command line parameters
-  if (argc != 2) {
-    std::cout << "Usage: " << argv[0] << " <input_directory>" << std::endl;
+  if (argc < 2) {
+    print_usage(argv[0]);
     return 0;
   }
+  if (std::string(argv[1]) == "--serve") {
+    if (argc != 3) {
+      print_usage(argv[0]);
+      return 0;
+    }
+    return serve(argv[2], FILE_WORKERS);
+  }
+  if (std::string(argv[1]) == "--pipe") {
+    std::string ground_filename, save_ground_filename, labels_filename;
+    for (int i = 2; i < argc; i += 2) {
+      std::string flag = argv[i];
+      if (i + 1 == argc || (flag != "--ground" && flag != "--save-ground" && flag != "--labels")) {
+        print_usage(argv[0]);
+        return 0;
+      }
+      (flag == "--ground" ? ground_filename : flag == "--save-ground" ? save_ground_filename : labels_filename)
+          = argv[i + 1];
+    }
+    if (!ground_filename.empty() && !save_ground_filename.empty()) {
+      print_usage(argv[0]);
+      return 0;
+    }
+    return flatten_pipe(ground_filename, save_ground_filename, labels_filename);
+  }
+  bbox roi;
+  bool use_roi = false;
+  bool resume = true;
+  std::string roi_arg;
+  std::vector<std::string> includes, excludes;
+  bool isolate = false;
+  bool sequence = false;
+  supervisor_limits limits = {1, 0, 0, 2};
+  for (int i = 2; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (arg == "--fresh") {
+      resume = false;
+      continue;
+    } else if (arg == "--isolate") {
+      isolate = true;
+      continue;
+    } else if (arg == "--sequence") {
+      sequence = true;
+      continue;
+    } else if (arg == "--max-memory" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+      limits.max_memory_mb = atoi(argv[i + 1]);
+    } else if (arg == "--timeout" && i + 1 < argc && atof(argv[i + 1]) > 0) {
+      limits.timeout_secs = atof(argv[i + 1]);
+    } else if (arg == "--attempts" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+      limits.max_attempts = atoi(argv[i + 1]);
+    } else if (arg == "--bbox" && i + 1 < argc && parse_bbox(argv[i + 1], &roi)) {
+      use_roi = true;
+      roi_arg = argv[i + 1];
+    } else if (arg == "--include" && i + 1 < argc) {
+      includes.push_back(argv[i + 1]);
+    } else if (arg == "--exclude" && i + 1 < argc) {
+      excludes.push_back(argv[i + 1]);
+    } else {
+      print_usage(argv[0]);
+      return 0;
+    }
+    i++;
+  }
+  if (sequence && (isolate || PLANE_GROUND_MODEL)) {
+    std::cout << "--sequence needs the percentile ground model and one process" << std::endl;
+    return 1;
+  }
+  // A frame's ground depends on every frame before it, so a sequence is always
+  // redone whole and not journaled (the batch journal is left as it was)
+  if (sequence) resume = false;
   std::string input_path(argv[1]);
   std::string output_path = path_join(input_path, "flat_output");
   boost::filesystem::create_directory(output_path);
-  std::vector<std::string> input_filenames;
-  get_files_with_ext(input_path, ".pcd", input_filenames);
-  for (std::string input_filename : input_filenames) {
-    std::string output_basename = filename_append(basename(input_filename), "_flat");
-    flatten_pcd(input_filename, path_join(output_path, output_basename));
-  }  
+
+  // Find inputs (not re-reading earlier outputs) and hand them out largest
+  // first, each to the next free worker, so no big file starts last
+  std::vector<input_file> input_files;
+  find_input_files(input_path, ".pcd", includes, excludes, output_path, input_files);
+  if (sequence) {
+    // frames in name order, one after another
+    std::sort(input_files.begin(), input_files.end(),
+              [](const input_file &a, const input_file &b) { return a.path < b.path; });
+  } else {
+    sort_largest_first(input_files);
+  }
+
+  // Outputs all go to flat_output/, so inputs of the same name in different
+  // subdirectories would overwrite each other's: refuse to start
+  std::string output_ext = COLUMNAR_OUTPUT ? ".fcol" : ".pcd";
+  std::vector<std::pair<std::string, std::string> > collisions;
+  find_output_collisions(input_files, output_ext, collisions);
+  for (auto const &c : collisions) {
+    std::cout << c.first << " and " << c.second << " would both be written to "
+              << path_join(output_path, output_basename(c.first, output_ext)) << std::endl;
+  }
+  if (!collisions.empty()) {
+    std::cout << "Rename the inputs or leave some out with --exclude" << std::endl;
+    return 1;
+  }
+
+  // Skip inputs a previous run already finished (or quarantined) with the
+  // same settings, and whose outputs, labels included, are all still there
+  std::string settings = run_settings(output_ext, use_roi ? roi_arg : "");
+  run_journal journal;
+  if (!sequence && !journal.open(path_join(output_path, ".flatten_journal"), resume)) {
+    std::cout << "Couldn't open the run journal in " << output_path << std::endl;
+    return 1;
+  }
+  std::vector<input_file> pending;
+  std::vector<std::string> output_filenames;
+  size_t num_quarantined = 0;
+  for (input_file const &f : input_files) {
+    std::string output_filename = path_join(output_path, output_basename(f.path, output_ext));
+    std::vector<std::string> outputs = {output_filename};
+    if (GROUND_LABELS) outputs.push_back(labels_filename(output_filename));
+    if (journal.finished(f, settings, outputs)) continue;
+    if (journal.quarantined(f, settings)) {
+      num_quarantined++;
+      continue;
+    }
+    pending.push_back(f);
+    output_filenames.push_back(output_filename);
+  }
+  if (pending.size() < input_files.size()) {
+    std::cout << "Resuming: " << input_files.size() - pending.size() << " of " << input_files.size()
+              << " files already done";
+    if (num_quarantined > 0) std::cout << " (" << num_quarantined << " quarantined)";
+    std::cout << std::endl;
+  }
+  input_files.swap(pending);
+  uintmax_t total_bytes = 0;
+  for (input_file const &f : input_files) total_bytes += f.size;
+  int num_workers = sequence ? 1 : std::max(1, std::min(FILE_WORKERS, (int) input_files.size()));
+  std::cout << "Flattening " << input_files.size() << " files (" << std::fixed << std::setprecision(1)
+            << total_bytes / 1e6 << " MB) with " << num_workers << " workers" << std::endl;
+  std::cout.unsetf(std::ios_base::floatfield);
+
+  if (isolate) {
+    limits.num_procs = num_workers;
+    return supervise_files(input_files, output_filenames, use_roi ? &roi : NULL, limits, journal, settings);
+  }
+
+  std::vector<flatten_workers> workers(num_workers);
+  world_ground world(GRID_SIDE_LEN, MIN_POINTS_PER_BLOCK);
+  if (sequence) workers[0].set_world_ground(&world);
+  std::atomic<size_t> next_file(0);
+  run_on_threads(num_workers, [&](int t) {
+    workers[t].set_num_threads(std::max(1, default_num_threads() / num_workers));
+    for (size_t i = next_file++; i < input_files.size(); i = next_file++) {
+      if (flatten_file(input_files[i].path, output_filenames[i], use_roi ? &roi : NULL, workers[t])
+          && !sequence && !journal.record(run_journal::entry(input_files[i], settings))) {
+        file_log() << "Couldn't journal " << input_files[i].path << std::endl;
+      }
+      flush_file_log();
+    }
+  });
   return 0;
 }
-
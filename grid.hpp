@@ -30,6 +30,14 @@ class grid {
   float s() {
     return this->section_len;
   }
+
+  float origin_x() {
+    return this->base_x;
+  }
+
+  float origin_y() {
+    return this->base_y;
+  }
   
   std::pair<int, int> compute_grid(bbox box) {
     float dx = box.maxx - box.minx;
@@ -41,6 +49,16 @@ class grid {
     return std::pair<int, int>(this->_h, this->_w);
   }
   
+  // Use an explicit origin and size instead of fitting a bbox,
+  // e.g. for a window onto the grid of a larger cloud
+  std::pair<int, int> set_window(float base_x, float base_y, int h, int w) {
+    this->_h = h;
+    this->_w = w;
+    this->base_x = base_x;
+    this->base_y = base_y;
+    return std::pair<int, int>(this->_h, this->_w);
+  }
+  
   std::pair<int, int> to_indices(float x, float y) {
     int x_idx = (int) ((x - base_x) / section_len);
     int y_idx = (int) ((y - base_y) / section_len);
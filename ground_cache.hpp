@@ -0,0 +1,90 @@
+#ifndef GROUND_CACHE_H
+#define GROUND_CACHE_H
+
+#include <iomanip>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "aux_types.h"
+#include "ground_plane.hpp"
+
+/* Ground rasters of recently flattened inputs, kept by a long-running
+ * server that is asked to flatten the same tiles again (another region,
+ * another output). A raster is keyed by the input's path, size and mtime
+ * and the box its grid was laid over, so a changed input or a different
+ * grid misses. The least recently used rasters are dropped past
+ * max_entries. Safe to share between threads. */
+
+struct ground_raster {
+  std::vector<float> floor_zs;      // ground height per cell, row major
+  std::vector<ground_plane> planes; // ground plane per cell (plane ground model only)
+};
+
+class ground_cache {
+
+  private:
+  typedef std::pair<std::string, std::shared_ptr<const ground_raster> > entry;
+  std::list<entry> lru; // most recently used first
+  std::map<std::string, std::list<entry>::iterator> index;
+  size_t max_entries;
+  size_t hits, misses;
+  std::mutex m;
+
+  public:
+
+  ground_cache(size_t max_entries) : max_entries(max_entries), hits(0), misses(0) {}
+
+  static std::string key(std::string filename, bbox grid_box) {
+    boost::system::error_code ec;
+    std::ostringstream oss;
+    oss << boost::filesystem::absolute(filename).string() << " "
+        << boost::filesystem::file_size(filename, ec) << " "
+        << (long long) boost::filesystem::last_write_time(filename, ec) << " " << std::setprecision(9)
+        << grid_box.minx << " " << grid_box.miny << " " << grid_box.maxx << " " << grid_box.maxy;
+    return oss.str();
+  }
+
+  /* The raster stored under key, or NULL */
+  std::shared_ptr<const ground_raster> find(std::string key) {
+    std::lock_guard<std::mutex> lock(m);
+    auto it = index.find(key);
+    if (it == index.end()) {
+      misses++;
+      return NULL;
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+  }
+
+  void insert(std::string key, std::shared_ptr<const ground_raster> raster) {
+    std::lock_guard<std::mutex> lock(m);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      lru.erase(it->second);
+      index.erase(it);
+    }
+    lru.push_front(entry(key, raster));
+    index[key] = lru.begin();
+    while (lru.size() > max_entries) {
+      index.erase(lru.back().first);
+      lru.pop_back();
+    }
+  }
+
+  void stats(size_t *num_entries, size_t *num_hits, size_t *num_misses) {
+    std::lock_guard<std::mutex> lock(m);
+    *num_entries = lru.size();
+    *num_hits = hits;
+    *num_misses = misses;
+  }
+};
+
+#endif // GROUND_CACHE_H
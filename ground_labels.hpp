@@ -0,0 +1,87 @@
+#ifndef GROUND_LABELS_H
+#define GROUND_LABELS_H
+
+#include <algorithm> // std::fill
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* Per-point ground labels, set by the adjust passes as they write each
+ * point's flattened z (its height above the interpolated floor): a point is
+ * ground if that height is below the label height. Kept as a bitmask, bit
+ * i % 8 of byte i / 8 for point i, and written next to the output as a
+ * sidecar file: one header line, then the mask bytes.
+ *
+ *   FLATTEN_LABELS 1 <num_points> <label_height>\n<(num_points + 7) / 8 bytes>
+ *
+ * The label is geometric only. Intensity is not used: its scale depends on
+ * the sensor, its calibration and the range, so no one threshold holds
+ * across files, and XYZ and XYZRGB inputs have none. Outputs keep the
+ * intensity, for classifiers downstream to combine with the mask. */
+
+inline size_t ground_label_bytes(size_t num_points) {
+  return (num_points + 7) / 8;
+}
+
+inline void set_ground_label(uint8_t *labels, size_t i) {
+  labels[i >> 3] |= (uint8_t) (1 << (i & 7));
+}
+
+inline bool ground_label(const uint8_t *labels, size_t i) {
+  return (labels[i >> 3] >> (i & 7)) & 1;
+}
+
+/* Labels in another point order: bit k of out is the label of point
+ * order[k]. out needs ground_label_bytes(num_points) bytes. */
+inline void reorder_ground_labels(const uint8_t *labels, const std::vector<uint32_t> &order, size_t num_points,
+                                  uint8_t *out) {
+  std::fill(out, out + ground_label_bytes(num_points), 0);
+  for (size_t k = 0; k < num_points; k++) {
+    if (ground_label(labels, order[k])) set_ground_label(out, k);
+  }
+}
+
+/* Header line of a labels file, for writers that stream the mask after it */
+inline void write_ground_labels_header(std::ostream &os, size_t num_points, float label_height) {
+  os << "FLATTEN_LABELS 1 " << num_points << " " << label_height << "\n";
+}
+
+/* Mask bytes of the first num_points labels; bits past them are written as
+ * zero. Streamed masks are written in pieces of a multiple of 8 points. */
+inline void write_ground_label_bytes(std::ostream &os, const uint8_t *labels, size_t num_points) {
+  size_t n = ground_label_bytes(num_points);
+  if (n > 1) os.write((const char *) labels, n - 1);
+  if (n > 0) {
+    uint8_t last = labels[n - 1];
+    if (num_points % 8) last &= (uint8_t) ((1 << (num_points % 8)) - 1);
+    os.write((const char *) &last, 1);
+  }
+}
+
+inline bool write_ground_labels(std::string filename, const uint8_t *labels, size_t num_points,
+                                float label_height) {
+  std::ofstream ofs(filename, std::ios_base::out | std::ios_base::binary);
+  write_ground_labels_header(ofs, num_points, label_height);
+  write_ground_label_bytes(ofs, labels, num_points);
+  ofs.close();
+  return (bool) ofs;
+}
+
+/* Sets labels and num_points; false if the file is missing or malformed */
+inline bool read_ground_labels(std::string filename, std::vector<uint8_t> &labels, size_t *num_points,
+                               float *label_height) {
+  std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+  std::string magic;
+  int version;
+  if (!(ifs >> magic >> version >> *num_points >> *label_height) || magic != "FLATTEN_LABELS" || version != 1
+      || ifs.get() != '\n') {
+    return false;
+  }
+  labels.resize(ground_label_bytes(*num_points));
+  ifs.read((char *) labels.data(), labels.size());
+  return ifs.gcount() == (std::streamsize) labels.size();
+}
+
+#endif // GROUND_LABELS_H
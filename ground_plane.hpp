@@ -0,0 +1,229 @@
+#ifndef GROUND_PLANE_H
+#define GROUND_PLANE_H
+
+#include <algorithm> // std::nth_element
+#include <cmath>
+#include <cstdint>
+#include <utility> // std::pair
+#include <vector>
+
+#include "dispatch.h"
+#include "flatten.hpp"
+#include "grid.hpp"
+#include "parallel.hpp"
+#include "util.h"
+
+/* Robust per-cell ground planes, as an alternative to a single percentile
+ * height per cell. Each cell fits z = z0 + dzdx * dx + dzdy * dy (dx, dy
+ * relative to the cell centre) to its lowest points with iteratively
+ * reweighted least squares, so the floor keeps the terrain's real slope
+ * instead of only the finite differences between neighbouring cells. */
+
+const float GROUND_PLANE_PERCENTILE = 0.3;   // fit to the lowest 30% of each cell
+const int GROUND_PLANE_ITERATIONS = 3;
+const float GROUND_PLANE_SCALE = 0.2;        // metres; residual scale for down-weighting points above the plane
+const int GROUND_PLANE_LANES = 8;            // accumulator lanes, fixed so results do not depend on the SIMD width
+const size_t GROUND_PLANE_MAX_SAMPLES = 128; // points per cell used in a fit (strided subsample of denser cells)
+
+struct ground_plane {
+  float z0, dzdx, dzdy;
+};
+
+/* Group the point ids by grid cell, as bin_zs does for z's. A plane fit
+ * reads only a subsample of each cell, so only the ids are moved and each
+ * fit gathers the coordinates of the points it samples. */
+inline void bin_point_ids(const std::vector<uint32_t> &cell_ids, int num_cells,
+                          std::vector<uint32_t> &cell_starts, std::vector<uint32_t> &cell_points) {
+  cell_starts.assign(num_cells + 1, 0);
+  cell_points.resize(cell_ids.size());
+  for (uint32_t c : cell_ids) {
+    cell_starts[c + 1]++;
+  }
+  for (int c = 0; c < num_cells; c++) {
+    cell_starts[c + 1] += cell_starts[c];
+  }
+  for (size_t i = 0; i < cell_ids.size(); i++) {
+    cell_points[cell_starts[cell_ids[i]]++] = (uint32_t) i;
+  }
+  for (int c = num_cells; c > 0; c--) {
+    cell_starts[c] = cell_starts[c - 1];
+  }
+  cell_starts[0] = 0;
+}
+
+/* Weight of a point in a plane fit. The first pass (no plane yet) uses the
+ * points at or below z_cut; later passes use each point's residual above
+ * the current plane, so points well above it (vegetation, cars) fade out. */
+template <bool Reweight>
+inline float plane_fit_weight(float x, float y, float z, float z_cut, const ground_plane &plane) {
+  if (!Reweight) return (z <= z_cut) ? 1.0f : 0.0f;
+  float r = (z - (plane.z0 + plane.dzdx * x + plane.dzdy * y)) * (1.0f / GROUND_PLANE_SCALE);
+  float r2 = r * r;
+  return (r <= 0) ? 1.0f : 1.0f / (1.0f + r2 * r2);
+}
+
+/* One weighted least-squares plane fit over n points, with z taken relative
+ * to z_cut for conditioning. Weights are computed inline and sums are kept
+ * in GROUND_PLANE_LANES independent lanes (a loop the compiler vectorizes),
+ * combined in a fixed order. Returns false if the fit is degenerate. */
+template <bool Reweight>
+HOT_KERNEL inline bool fit_plane_pass(const float *xs, const float *ys, const float *zs, size_t n,
+                                      float z_cut, ground_plane *plane) {
+  const int L = GROUND_PLANE_LANES;
+  const ground_plane prev = *plane;
+  float sw[L] = {0}, sx[L] = {0}, sy[L] = {0}, sz[L] = {0};
+  float sxx[L] = {0}, sxy[L] = {0}, syy[L] = {0}, sxz[L] = {0}, syz[L] = {0};
+  // point i goes to lane i % L: whole blocks first (fixed trip count, so the
+  // lanes map onto vector registers), then the partial block at the end
+  auto accumulate = [&](int j, size_t i) {
+    float x = xs[i], y = ys[i], z = zs[i];
+    float w = plane_fit_weight<Reweight>(x, y, z, z_cut, prev);
+    z -= z_cut;
+    sw[j] += w;
+    sx[j] += w * x;
+    sy[j] += w * y;
+    sz[j] += w * z;
+    sxx[j] += w * x * x;
+    sxy[j] += w * x * y;
+    syy[j] += w * y * y;
+    sxz[j] += w * x * z;
+    syz[j] += w * y * z;
+  };
+  size_t i = 0;
+  for (; i + L <= n; i += L) {
+    for (int j = 0; j < L; j++) accumulate(j, i + j);
+  }
+  for (int j = 0; i + j < n; j++) accumulate(j, i + j);
+  double W = 0, X = 0, Y = 0, Z = 0, XX = 0, XY = 0, YY = 0, XZ = 0, YZ = 0;
+  for (int j = 0; j < L; j++) {
+    W += sw[j]; X += sx[j]; Y += sy[j]; Z += sz[j];
+    XX += sxx[j]; XY += sxy[j]; YY += syy[j]; XZ += sxz[j]; YZ += syz[j];
+  }
+  // normal equations [XX XY X; XY YY Y; X Y W] [a b c]' = [XZ YZ Z]', by Cramer's rule
+  double det = XX * (YY * W - Y * Y) - XY * (XY * W - Y * X) + X * (XY * Y - YY * X);
+  if (W <= 0 || std::fabs(det) < 1e-9 * W * W * W) return false;
+  double a = (XZ * (YY * W - Y * Y) - XY * (YZ * W - Y * Z) + X * (YZ * Y - YY * Z)) / det;
+  double b = (XX * (YZ * W - Z * Y) - XZ * (XY * W - Y * X) + X * (XY * Z - YZ * X)) / det;
+  double c = (XX * (YY * Z - Y * YZ) - XY * (XY * Z - YZ * X) + XZ * (XY * Y - YY * X)) / det;
+  plane->dzdx = a;
+  plane->dzdy = b;
+  plane->z0 = z_cut + c;
+  return true;
+}
+
+/* Per-thread buffers for fitting one cell at a time */
+struct plane_fit_buffers {
+  std::vector<float> xs, ys, zs, sorted;
+};
+
+/* Fit one cell, given the ids of its n points: first to its lowest points,
+ * then reweighting by residual. Cells are fit to an evenly strided
+ * subsample of at most GROUND_PLANE_MAX_SAMPLES points (x, y taken relative
+ * to the cell centre), which keeps the cost per cell bounded. Points far
+ * above the first fit would get ~zero weight, so only the rest are kept for
+ * the reweighted passes. */
+template <typename PointContainer>
+ground_plane fit_cell_plane(const PointContainer &points, const uint32_t *ids, size_t n,
+                            std::pair<float, float> center, plane_fit_buffers &buf) {
+  size_t stride = (n + GROUND_PLANE_MAX_SAMPLES - 1) / GROUND_PLANE_MAX_SAMPLES;
+  size_t m = 0;
+  buf.xs.resize(n / stride + 1);
+  buf.ys.resize(n / stride + 1);
+  buf.zs.resize(n / stride + 1);
+  for (size_t i = 0; i < n; i += stride, m++) {
+    auto const &p = points[ids[i]];
+    buf.xs[m] = p.x - center.first;
+    buf.ys[m] = p.y - center.second;
+    buf.zs[m] = p.z;
+  }
+  std::vector<float> &sorted = buf.sorted;
+  sorted.assign(buf.zs.begin(), buf.zs.begin() + m);
+  size_t k = m * GROUND_PLANE_PERCENTILE;
+  std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+  float z_cut = sorted[k];
+  ground_plane plane = {z_cut, 0, 0};
+  if (!fit_plane_pass<false>(buf.xs.data(), buf.ys.data(), buf.zs.data(), m, z_cut, &plane)) return plane;
+
+  // keep candidates that can still carry weight (branch-free compaction, in place)
+  const float MAX_RESIDUAL = 4 * GROUND_PLANE_SCALE;
+  size_t num_candidates = 0;
+  for (size_t i = 0; i < m; i++) {
+    float x = buf.xs[i], y = buf.ys[i], z = buf.zs[i];
+    buf.xs[num_candidates] = x;
+    buf.ys[num_candidates] = y;
+    buf.zs[num_candidates] = z;
+    num_candidates += (z - (plane.z0 + plane.dzdx * x + plane.dzdy * y) < MAX_RESIDUAL);
+  }
+  for (int iter = 1; iter < GROUND_PLANE_ITERATIONS; iter++) {
+    if (!fit_plane_pass<true>(buf.xs.data(), buf.ys.data(), buf.zs.data(), num_candidates, z_cut, &plane)) break;
+  }
+  return plane;
+}
+
+/* Fit every cell of pcl_grid (binned by bin_point_ids) with more than
+ * min_points_per_block points, cells split across threads. buffers holds
+ * one set per thread, kept by the caller so they are reused across calls. */
+template <typename PointContainer>
+void fit_ground_planes(const PointContainer &points, const std::vector<uint32_t> &cell_starts,
+                       const std::vector<uint32_t> &cell_points, grid &pcl_grid,
+                       unsigned int min_points_per_block, int num_threads,
+                       std::vector<plane_fit_buffers> &buffers, std::vector<ground_plane> &planes) {
+  size_t num_cells = cell_starts.size() - 1;
+  int w = pcl_grid.w();
+  planes.assign(num_cells, ground_plane{0, 0, 0});
+  if (buffers.size() < (size_t) num_threads) buffers.resize(num_threads);
+  run_on_threads(num_threads, [&](int t) {
+    plane_fit_buffers &buf = buffers[t];
+    // interleave cells so dense and empty regions are shared evenly
+    for (size_t c = t; c < num_cells; c += num_threads) {
+      size_t begin = cell_starts[c];
+      size_t n = cell_starts[c + 1] - begin;
+      if (n > min_points_per_block) { // skip sections with very few points
+        planes[c] = fit_cell_plane(points, &cell_points[begin], n, pcl_grid.center_coords(c / w, c % w), buf);
+      }
+    }
+  });
+}
+
+/* Adjust each point using the planes of the four cells around it: the floor
+ * height and slope are each plane evaluated at the point, blended bilinearly */
+template <typename Options = default_flatten_options, typename PointContainer>
+void adjust_points(PointContainer &points, grid &pcl_grid, const std::vector<ground_plane> &planes) {
+  int w = pcl_grid.w();
+  for (auto &p : points) {
+    std::pair<int, int> indices = pcl_grid.to_indices(p.x, p.y);
+    std::pair<float, float> center = pcl_grid.center_coords(indices.first, indices.second);
+    float dx_ratio = (p.x - center.first) / pcl_grid.s();
+    float dy_ratio = (p.y - center.second) / pcl_grid.s();
+    if (dy_ratio < 0) {
+      indices.first--;
+      dy_ratio += 1.0;
+    }
+    if (dx_ratio < 0) {
+      indices.second--;
+      dx_ratio += 1.0;
+    }
+    int ys[2] = {int_clamp(indices.first, 0, pcl_grid.h() - 1), int_clamp(indices.first + 1, 0, pcl_grid.h() - 1)};
+    int xs[2] = {int_clamp(indices.second, 0, w - 1), int_clamp(indices.second + 1, 0, w - 1)};
+    // bottom-left, bottom-right, top-left, top-right
+    float zs[4], dzdxs[4], dzdys[4];
+    for (int k = 0; k < 4; k++) {
+      int y_idx = ys[k / 2], x_idx = xs[k % 2];
+      ground_plane const &plane = planes[y_idx * w + x_idx];
+      std::pair<float, float> c = pcl_grid.center_coords(y_idx, x_idx);
+      zs[k] = plane.z0 + plane.dzdx * (p.x - c.first) + plane.dzdy * (p.y - c.second);
+      dzdxs[k] = plane.dzdx;
+      dzdys[k] = plane.dzdy;
+    }
+    float floor_z = lerp_2d(zs[0], zs[1], zs[2], zs[3], dx_ratio, dy_ratio);
+    if (!Options::adjust_slope) {
+      p.z -= floor_z;
+      continue;
+    }
+    float x_theta = std::atan(lerp_2d(dzdxs[0], dzdxs[1], dzdxs[2], dzdxs[3], dx_ratio, dy_ratio));
+    float y_theta = std::atan(lerp_2d(dzdys[0], dzdys[1], dzdys[2], dzdys[3], dx_ratio, dy_ratio));
+    adjust_point_to_floor(&p, floor_z, x_theta, y_theta);
+  }
+}
+
+#endif // GROUND_PLANE_H
@@ -0,0 +1,148 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <atomic>
+#include <cstdio> // std::rename
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include "aux_types.h"
+
+/* Crash-safe batch output.
+ *
+ * Outputs are written to <output>.part.<pid>.<writer>, flushed to disk and
+ * renamed over the final name, so an interrupted run never leaves a
+ * truncated output behind. Each finished input is then appended to a run journal, one line
+ * per input keyed by its status ("done", or "quarantined" when it was given
+ * up on), path, size, mtime and the run's settings. A restarted batch skips
+ * the inputs the journal lists, and redoes any input that has changed or
+ * whose output has gone missing since. */
+
+/****************************************/
+/*           Atomic Outputs             */
+/****************************************/
+
+/* Partial file of filename for the calling process and thread, so two
+ * writers of the same output (e.g. two server requests for it) never write
+ * into one file: each renames its own, and the last rename wins whole */
+inline std::string partial_filename(std::string filename) {
+  static std::atomic<int> num_writers(0);
+  thread_local int writer = num_writers++;
+  return filename + ".part." + std::to_string(getpid()) + "." + std::to_string(writer);
+}
+
+/* fsync a file or directory by name; returns false on error */
+inline bool sync_path(std::string path, int flags) {
+  int fd = ::open(path.c_str(), flags);
+  if (fd < 0) return false;
+  bool ok = (::fsync(fd) == 0);
+  ::close(fd);
+  return ok;
+}
+
+/* Flush the finished partial file of filename to disk and rename it into
+ * place, so readers see either the previous file or all of the new one */
+inline bool commit_partial_file(std::string filename) {
+  std::string partial = partial_filename(filename);
+  if (!sync_path(partial, O_RDONLY)) return false;
+  if (std::rename(partial.c_str(), filename.c_str()) != 0) return false;
+  // persist the rename itself
+  std::string dir = boost::filesystem::path(filename).parent_path().string();
+  sync_path(dir.empty() ? "." : dir, O_RDONLY | O_DIRECTORY);
+  return true;
+}
+
+/****************************************/
+/*             Run Journal              */
+/****************************************/
+
+class run_journal {
+
+  private:
+  int fd;
+  std::set<std::string> entries;
+  std::mutex m;
+
+  public:
+
+  run_journal() : fd(-1) {}
+
+  ~run_journal() {
+    if (fd >= 0) ::close(fd);
+  }
+
+  /* Open the journal at filename, keeping its entries to resume from, or
+   * starting a new one if resume is false. Returns false on I/O error. */
+  bool open(std::string filename, bool resume) {
+    bool cut_off = false;
+    if (resume) {
+      std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+      std::stringstream contents;
+      contents << ifs.rdbuf();
+      std::string text = contents.str();
+      // a line cut off by a crash has no newline and is ignored
+      size_t begin = 0;
+      for (size_t end = text.find('\n'); end != std::string::npos; end = text.find('\n', begin)) {
+        entries.insert(text.substr(begin, end - begin));
+        begin = end + 1;
+      }
+      cut_off = (begin < text.size());
+    }
+    fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC), 0644);
+    if (fd < 0) return false;
+    // end the cut off line, so the next entry is not appended to it
+    return !cut_off || ::write(fd, "\n", 1) == 1;
+  }
+
+  /* Journal entry for an input under the given run settings (no newlines) */
+  static std::string entry(const input_file &f, std::string settings, std::string status = "done") {
+    boost::system::error_code ec;
+    std::ostringstream oss;
+    oss << status << " " << f.size << " " << (long long) boost::filesystem::last_write_time(f.path, ec)
+        << " " << settings << " " << boost::filesystem::absolute(f.path).string();
+    return oss.str();
+  }
+
+  bool contains(std::string entry) {
+    std::lock_guard<std::mutex> lock(m);
+    return entries.count(entry) > 0;
+  }
+
+  /* Whether a previous run finished f under settings, and every output it
+   * wrote for f is still there (else f is redone) */
+  bool finished(const input_file &f, std::string settings, const std::vector<std::string> &outputs) {
+    if (!contains(entry(f, settings))) return false;
+    boost::system::error_code ec;
+    for (std::string const &output : outputs) {
+      if (!boost::filesystem::exists(output, ec)) return false;
+    }
+    return true;
+  }
+
+  /* Whether a previous run gave up on f, unchanged since, under settings */
+  bool quarantined(const input_file &f, std::string settings) {
+    return contains(entry(f, settings, "quarantined"));
+  }
+
+  /* Record entry durably (one appended line, fsynced); returns false on I/O error */
+  bool record(std::string entry) {
+    std::lock_guard<std::mutex> lock(m);
+    std::string line = entry + "\n";
+    if (::write(fd, line.data(), line.size()) != (ssize_t) line.size() || ::fsync(fd) != 0) {
+      return false;
+    }
+    entries.insert(entry);
+    return true;
+  }
+};
+
+#endif // JOURNAL_H
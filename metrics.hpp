@@ -0,0 +1,63 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <sstream>
+#include <string>
+
+#include <sys/resource.h>
+
+#include "util.h" // format_number
+
+/* Per-file resource usage, printed after each file is flattened */
+struct file_metrics {
+  size_t num_points;
+  double seconds;
+  size_t scratch_allocations; // scratch buffer growths while processing the file
+  size_t scratch_bytes;       // scratch capacity held by the worker afterwards
+  long minor_faults;          // of the whole process while the file ran, see file_timer
+  long major_faults;
+};
+
+/* Measures wall time and page faults between start() and stop(). Faults are
+ * those of the whole process, so they include the stage threads a file
+ * spawns (and, with several file workers, the other files in flight). */
+class file_timer {
+
+  private:
+  std::chrono::steady_clock::time_point start_time;
+  long start_minflt, start_majflt;
+
+  static void process_faults(long *minflt, long *majflt) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    *minflt = usage.ru_minflt;
+    *majflt = usage.ru_majflt;
+  }
+
+  public:
+
+  void start() {
+    this->start_time = std::chrono::steady_clock::now();
+    process_faults(&start_minflt, &start_majflt);
+  }
+
+  void stop(file_metrics *m) {
+    m->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    long minflt, majflt;
+    process_faults(&minflt, &majflt);
+    m->minor_faults = minflt - start_minflt;
+    m->major_faults = majflt - start_majflt;
+  }
+};
+
+inline std::string metrics_to_str(const file_metrics &m) {
+  std::ostringstream oss;
+  oss << format_number(m.num_points) << " points in " << (int) (m.seconds * 1000) << " ms, "
+      << m.scratch_allocations << " scratch allocations ("
+      << format_number(m.scratch_bytes) << "B held), "
+      << m.minor_faults << " minor / " << m.major_faults << " major page faults process-wide";
+  return oss.str();
+}
+
+#endif // METRICS_H
@@ -0,0 +1,127 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <cstdint>
+#include <utility> // std::pair
+#include <vector>
+
+#include "grid.hpp"
+#include "parallel.hpp"
+
+/* Spread the low 16 bits of n so there is a zero bit between each of them */
+inline uint32_t part_1_by_1(uint32_t n) {
+  n &= 0x0000ffff;
+  n = (n | (n << 8)) & 0x00ff00ff;
+  n = (n | (n << 4)) & 0x0f0f0f0f;
+  n = (n | (n << 2)) & 0x33333333;
+  n = (n | (n << 1)) & 0x55555555;
+  return n;
+}
+
+/* Z-order (Morton) code of a grid cell, x in the even bits and y in the odd bits */
+inline uint32_t morton_encode(uint32_t x_idx, uint32_t y_idx) {
+  return part_1_by_1(x_idx) | (part_1_by_1(y_idx) << 1);
+}
+
+const int RADIX_SORT_BUCKETS = 256; // 8 bits per pass
+
+/* Temporaries of radix_sort_by_key, for callers that reuse them across sorts.
+ * They never need more than n keys and values and num_threads *
+ * RADIX_SORT_BUCKETS offsets. */
+struct radix_sort_buffers {
+  std::vector<uint32_t> keys_tmp, values_tmp;
+  std::vector<size_t> offsets;
+};
+
+/* Stable LSD radix sort of values by keys, 8 bits per pass.
+ * Each thread histograms and scatters its own contiguous slice, so the
+ * result is identical for any thread count. Passes above the highest set
+ * key bit are skipped. The passes swap keys and values with the buffers'. */
+inline void radix_sort_by_key(std::vector<uint32_t> &keys, std::vector<uint32_t> &values,
+                              int num_threads, radix_sort_buffers &buf) {
+  const size_t n = keys.size();
+  const int RADIX = RADIX_SORT_BUCKETS;
+  const size_t MIN_POINTS_PER_THREAD = 1 << 16;
+  if (num_threads < 1) num_threads = 1;
+  if (n / num_threads < MIN_POINTS_PER_THREAD) {
+    num_threads = std::max<size_t>(1, n / MIN_POINTS_PER_THREAD);
+  }
+  uint32_t key_bits = 0;
+  for (uint32_t k : keys) key_bits |= k;
+  std::vector<uint32_t> &keys_tmp = buf.keys_tmp, &values_tmp = buf.values_tmp;
+  std::vector<size_t> &offsets = buf.offsets;
+  keys_tmp.resize(n);
+  values_tmp.resize(n);
+  offsets.resize(num_threads * RADIX);
+  for (int shift = 0; shift < 32 && (key_bits >> shift); shift += 8) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+    run_on_threads(num_threads, [&](int t) {
+      size_t begin, end;
+      thread_slice(n, num_threads, t, &begin, &end);
+      size_t *counts = &offsets[t * RADIX];
+      for (size_t i = begin; i < end; i++) {
+        counts[(keys[i] >> shift) & 0xff]++;
+      }
+    });
+    // exclusive prefix sum in (digit, thread) order keeps the sort stable
+    size_t sum = 0;
+    for (int d = 0; d < RADIX; d++) {
+      for (int t = 0; t < num_threads; t++) {
+        size_t count = offsets[t * RADIX + d];
+        offsets[t * RADIX + d] = sum;
+        sum += count;
+      }
+    }
+    run_on_threads(num_threads, [&](int t) {
+      size_t begin, end;
+      thread_slice(n, num_threads, t, &begin, &end);
+      size_t *next = &offsets[t * RADIX];
+      for (size_t i = begin; i < end; i++) {
+        size_t pos = next[(keys[i] >> shift) & 0xff]++;
+        keys_tmp[pos] = keys[i];
+        values_tmp[pos] = values[i];
+      }
+    });
+    keys.swap(keys_tmp);
+    values.swap(values_tmp);
+  }
+}
+
+inline void radix_sort_by_key(std::vector<uint32_t> &keys, std::vector<uint32_t> &values,
+                              int num_threads) {
+  radix_sort_buffers buf;
+  radix_sort_by_key(keys, values, num_threads, buf);
+}
+
+/* Compute the permutation that visits points in Morton order of their grid cell:
+ * order[i] is the input index of the i-th point in sorted order.
+ * keys and buf are scratch space, as for radix_sort_by_key. */
+template <typename PointContainer>
+void morton_order(const PointContainer &points, grid &pcl_grid, std::vector<uint32_t> &order,
+                  int num_threads, std::vector<uint32_t> &keys, radix_sort_buffers &buf) {
+  const size_t n = points.size();
+  keys.resize(n);
+  order.resize(n);
+  run_on_threads(num_threads, [&](int t) {
+    size_t begin, end;
+    thread_slice(n, num_threads, t, &begin, &end);
+    for (size_t i = begin; i < end; i++) {
+      std::pair<int, int> indices = pcl_grid.to_indices(points[i].x, points[i].y);
+      uint32_t y_idx = (uint32_t) int_clamp(indices.first, 0, 0xffff);
+      uint32_t x_idx = (uint32_t) int_clamp(indices.second, 0, 0xffff);
+      keys[i] = morton_encode(x_idx, y_idx);
+      order[i] = (uint32_t) i;
+    }
+  });
+  radix_sort_by_key(keys, order, num_threads, buf);
+}
+
+template <typename PointContainer>
+void morton_order(const PointContainer &points, grid &pcl_grid,
+                  std::vector<uint32_t> &order, int num_threads) {
+  std::vector<uint32_t> keys;
+  radix_sort_buffers buf;
+  morton_order(points, pcl_grid, order, num_threads, keys, buf);
+}
+
+#endif // MORTON_H
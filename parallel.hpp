@@ -0,0 +1,38 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm> // std::min
+#include <thread>
+#include <vector>
+
+/* Number of worker threads to use when none is specified */
+inline int default_num_threads() {
+  unsigned int n = std::thread::hardware_concurrency();
+  return (n > 0) ? (int) n : 1;
+}
+
+/* Run f(thread_index) on num_threads threads (the calling thread runs index 0) */
+template <typename Function>
+void run_on_threads(int num_threads, Function f) {
+  if (num_threads <= 1) {
+    f(0);
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; t++) {
+    threads.push_back(std::thread(f, t));
+  }
+  f(0);
+  for (std::thread &th : threads) {
+    th.join();
+  }
+}
+
+/* Split [0, n) into num_threads contiguous slices and return slice t as [*begin, *end) */
+inline void thread_slice(size_t n, int num_threads, int t, size_t *begin, size_t *end) {
+  size_t chunk = (n + num_threads - 1) / num_threads;
+  *begin = std::min(n, chunk * t);
+  *end = std::min(n, *begin + chunk);
+}
+
+#endif // PARALLEL_H
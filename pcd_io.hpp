@@ -0,0 +1,214 @@
+#ifndef PCD_IO_H
+#define PCD_IO_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "point_traits.hpp"
+
+/* Minimal native PCD reader for the parts of the tool that cannot go
+ * through pcl::io (partial reads, streams). Handles ascii and binary data
+ * with any mix of F/I/U fields; binary_compressed is left to PCL. */
+
+struct pcd_header {
+  std::vector<std::string> lines;  // raw header lines up to and including DATA
+  std::vector<std::string> fields;
+  std::vector<int> sizes;
+  std::vector<char> types;
+  std::vector<int> counts;
+  std::vector<int> offsets;        // byte offset of each field in a binary record
+  size_t width, height, points;
+  int point_size;                  // bytes per binary record
+  std::string data;                // "ascii", "binary" or "binary_compressed"
+
+  pcd_header() : width(0), height(1), points(0), point_size(0) {}
+
+  /* Index of the named field, or -1 */
+  int field_index(std::string name) const {
+    for (size_t i = 0; i < fields.size(); i++) {
+      if (fields[i] == name) return i;
+    }
+    return -1;
+  }
+
+  /* Index of the first value of field i within an ascii line */
+  int ascii_column(int field) const {
+    int col = 0;
+    for (int i = 0; i < field; i++) col += counts[i];
+    return col;
+  }
+};
+
+/* Parse header lines up to DATA, leaving is at the first point record.
+ * Returns false if the stream ends first or the header is inconsistent. */
+inline bool read_pcd_header(std::istream &is, pcd_header &h) {
+  std::string line;
+  while (std::getline(is, line)) {
+    if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+    h.lines.push_back(line);
+    std::istringstream iss(line);
+    std::string key;
+    iss >> key;
+    if (key == "FIELDS") {
+      std::string f;
+      while (iss >> f) h.fields.push_back(f);
+    } else if (key == "SIZE") {
+      int v;
+      while (iss >> v) h.sizes.push_back(v);
+    } else if (key == "TYPE") {
+      char c;
+      while (iss >> c) h.types.push_back(c);
+    } else if (key == "COUNT") {
+      int v;
+      while (iss >> v) h.counts.push_back(v);
+    } else if (key == "WIDTH") {
+      iss >> h.width;
+    } else if (key == "HEIGHT") {
+      iss >> h.height;
+    } else if (key == "POINTS") {
+      iss >> h.points;
+    } else if (key == "DATA") {
+      iss >> h.data;
+      if (h.counts.empty()) h.counts.assign(h.fields.size(), 1);
+      if (h.sizes.size() != h.fields.size() || h.types.size() != h.fields.size()
+          || h.counts.size() != h.fields.size()) {
+        return false;
+      }
+      if (h.points == 0) h.points = h.width * h.height;
+      h.point_size = 0;
+      for (size_t i = 0; i < h.fields.size(); i++) {
+        h.offsets.push_back(h.point_size);
+        h.point_size += h.sizes[i] * h.counts[i];
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Value of field i in a binary record */
+inline double binary_field_value(const pcd_header &h, const char *record, int i) {
+  const char *p = record + h.offsets[i];
+  switch (h.types[i]) {
+    case 'F':
+      if (h.sizes[i] == 8) { double v; memcpy(&v, p, 8); return v; }
+      else { float v; memcpy(&v, p, 4); return v; }
+    case 'I':
+      if (h.sizes[i] == 1) { int8_t v; memcpy(&v, p, 1); return v; }
+      if (h.sizes[i] == 2) { int16_t v; memcpy(&v, p, 2); return v; }
+      if (h.sizes[i] == 8) { int64_t v; memcpy(&v, p, 8); return v; }
+      { int32_t v; memcpy(&v, p, 4); return v; }
+    default: // 'U'
+      if (h.sizes[i] == 1) { uint8_t v; memcpy(&v, p, 1); return v; }
+      if (h.sizes[i] == 2) { uint16_t v; memcpy(&v, p, 2); return v; }
+      if (h.sizes[i] == 8) { uint64_t v; memcpy(&v, p, 8); return v; }
+      { uint32_t v; memcpy(&v, p, 4); return v; }
+  }
+}
+
+/* Raw 32 bits of packed field i in a binary record (the float value's bits
+ * if the field is not 4 bytes wide) */
+inline uint32_t binary_field_bits(const pcd_header &h, const char *record, int i) {
+  uint32_t bits;
+  if (h.sizes[i] == 4) {
+    memcpy(&bits, record + h.offsets[i], 4);
+  } else {
+    float v = binary_field_value(h, record, i);
+    memcpy(&bits, &v, 4);
+  }
+  return bits;
+}
+
+/* Raw 32 bits of a packed field's ascii token: PCL writes them as an
+ * unsigned integer (even for TYPE F), other writers may write the float */
+inline uint32_t ascii_field_bits(const char *token) {
+  char *end;
+  unsigned long long v = strtoull(token, &end, 10);
+  if (end != token && *token != '-' && (*end == 0 || *end == ' ' || *end == '\t' || *end == '\r')) {
+    return (uint32_t) v;
+  }
+  float f = strtof(token, NULL);
+  uint32_t bits;
+  memcpy(&bits, &f, 4);
+  return bits;
+}
+
+/* Whether the header has x, y, z and every other field PointT is read from */
+template <typename PointT>
+bool pcd_has_fields(const pcd_header &h) {
+  if (h.field_index("x") < 0 || h.field_index("y") < 0 || h.field_index("z") < 0) return false;
+  for (int i = 0; i < point_traits<PointT>::num_fields; i++) {
+    if (h.field_index(point_traits<PointT>::field(i)) < 0) return false;
+  }
+  return true;
+}
+
+/* Decodes x, y, z and the point type's other fields (0 where the file lacks them) */
+template <typename PointT>
+class pcd_point_decoder {
+
+  private:
+  typedef point_traits<PointT> traits;
+  static const int NUM_FIELDS = 3 + traits::num_fields;
+  int fields[NUM_FIELDS];   // x, y, z, then traits' field indices (may be -1)
+  int columns[NUM_FIELDS];  // same, as ascii columns
+  std::vector<const char *> tokens;
+
+  public:
+
+  /* Returns false if the header has no x/y/z fields */
+  bool init(const pcd_header &h) {
+    const char *xyz[3] = {"x", "y", "z"};
+    for (int i = 0; i < NUM_FIELDS; i++) {
+      fields[i] = h.field_index(i < 3 ? xyz[i] : traits::field(i - 3));
+      columns[i] = (fields[i] >= 0) ? h.ascii_column(fields[i]) : -1;
+    }
+    return fields[0] >= 0 && fields[1] >= 0 && fields[2] >= 0;
+  }
+
+  void decode_binary(const pcd_header &h, const char *record, PointT &p) {
+    p.x = binary_field_value(h, record, fields[0]);
+    p.y = binary_field_value(h, record, fields[1]);
+    p.z = binary_field_value(h, record, fields[2]);
+    for (int i = 3; i < NUM_FIELDS; i++) {
+      if (traits::packed(i - 3)) {
+        traits::set_packed_field(p, i - 3, (fields[i] >= 0) ? binary_field_bits(h, record, fields[i]) : 0);
+      } else {
+        traits::set_field(p, i - 3, (fields[i] >= 0) ? binary_field_value(h, record, fields[i]) : 0);
+      }
+    }
+  }
+
+  /* Returns false if the line has too few values */
+  bool decode_ascii(const std::string &line, PointT &p) {
+    tokens.clear();
+    const char *s = line.c_str();
+    while (*s) {
+      while (*s == ' ' || *s == '\t' || *s == '\r') s++;
+      if (!*s) break;
+      tokens.push_back(s);
+      while (*s && *s != ' ' && *s != '\t' && *s != '\r') s++;
+    }
+    for (int i = 0; i < NUM_FIELDS; i++) {
+      if (columns[i] >= (int) tokens.size()) return false;
+    }
+    p.x = strtod(tokens[columns[0]], NULL);
+    p.y = strtod(tokens[columns[1]], NULL);
+    p.z = strtod(tokens[columns[2]], NULL);
+    for (int i = 3; i < NUM_FIELDS; i++) {
+      if (traits::packed(i - 3)) {
+        traits::set_packed_field(p, i - 3, (columns[i] >= 0) ? ascii_field_bits(tokens[columns[i]]) : 0);
+      } else {
+        traits::set_field(p, i - 3, (columns[i] >= 0) ? strtod(tokens[columns[i]], NULL) : 0);
+      }
+    }
+    return true;
+  }
+};
+
+#endif // PCD_IO_H
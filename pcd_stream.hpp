@@ -0,0 +1,217 @@
+#ifndef PCD_STREAM_H
+#define PCD_STREAM_H
+
+#include <algorithm> // std::sort
+#include <cstdio> // snprintf
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "aux_types.h"
+#include "grid.hpp"
+#include "pcd_io.hpp"
+
+/* Streaming PCD rewrite for pipe mode: point records are read from a
+ * stream in batches and written back in the same format (ascii or binary)
+ * with new x, y, z and every other field byte-for-byte as read. */
+
+/****************************************/
+/*            Point Records             */
+/****************************************/
+
+/* Store v into field i of a binary record, converted to the field's type */
+inline void set_binary_field_value(const pcd_header &h, char *record, int i, double v) {
+  char *p = record + h.offsets[i];
+  switch (h.types[i]) {
+    case 'F':
+      if (h.sizes[i] == 8) { memcpy(p, &v, 8); }
+      else { float f = v; memcpy(p, &f, 4); }
+      return;
+    case 'I':
+      if (h.sizes[i] == 1) { int8_t n = v; memcpy(p, &n, 1); return; }
+      if (h.sizes[i] == 2) { int16_t n = v; memcpy(p, &n, 2); return; }
+      if (h.sizes[i] == 8) { int64_t n = v; memcpy(p, &n, 8); return; }
+      { int32_t n = v; memcpy(p, &n, 4); return; }
+    default: // 'U'
+      if (h.sizes[i] == 1) { uint8_t n = v; memcpy(p, &n, 1); return; }
+      if (h.sizes[i] == 2) { uint16_t n = v; memcpy(p, &n, 2); return; }
+      if (h.sizes[i] == 8) { uint64_t n = v; memcpy(p, &n, 8); return; }
+      { uint32_t n = v; memcpy(p, &n, 4); return; }
+  }
+}
+
+inline void write_pcd_header(std::ostream &os, const pcd_header &h) {
+  for (std::string const &line : h.lines) os << line << "\n";
+}
+
+/* A batch of point records as read, whose x, y, z can be read and replaced */
+class pcd_record_buffer {
+
+  private:
+  const pcd_header *h;
+  int fields[3];                  // x, y, z
+  int columns[3];                 // same, as ascii columns
+  std::vector<char> data;         // binary records back to back
+  std::vector<std::string> lines; // or ascii lines
+  size_t num_records;
+  std::vector<size_t> starts, lengths; // tokenize() output, reused
+
+  bool binary() const {
+    return h->data == "binary";
+  }
+
+  /* Start of each whitespace-separated token of an ascii line, and its length */
+  static void tokenize(const std::string &line, std::vector<size_t> &starts, std::vector<size_t> &lengths) {
+    starts.clear();
+    lengths.clear();
+    size_t i = 0;
+    while (i < line.size()) {
+      while (i < line.size() && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r')) i++;
+      if (i == line.size()) break;
+      starts.push_back(i);
+      while (i < line.size() && line[i] != ' ' && line[i] != '\t' && line[i] != '\r') i++;
+      lengths.push_back(i - starts.back());
+    }
+  }
+
+  public:
+
+  pcd_record_buffer() : h(NULL), num_records(0) {}
+
+  /* Returns false without x/y/z fields, or for binary_compressed data */
+  bool init(const pcd_header &header) {
+    h = &header;
+    const char *xyz[3] = {"x", "y", "z"};
+    for (int i = 0; i < 3; i++) {
+      fields[i] = h->field_index(xyz[i]);
+      if (fields[i] < 0) return false;
+      columns[i] = h->ascii_column(fields[i]);
+    }
+    return h->data == "binary" || h->data == "ascii";
+  }
+
+  size_t size() const {
+    return num_records;
+  }
+
+  void clear() {
+    data.clear();
+    lines.clear();
+    num_records = 0;
+  }
+
+  /* Append up to max_records records from is; returns the number read.
+   * Blank ascii lines are skipped. */
+  size_t read(std::istream &is, size_t max_records) {
+    size_t n = 0;
+    if (binary()) {
+      size_t old_size = data.size();
+      data.resize(old_size + max_records * h->point_size);
+      is.read(&data[old_size], max_records * h->point_size);
+      n = is.gcount() / h->point_size;
+      data.resize(old_size + n * h->point_size);
+    } else {
+      std::string line;
+      while (n < max_records && std::getline(is, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        lines.push_back(line);
+        n++;
+      }
+    }
+    num_records += n;
+    return n;
+  }
+
+  lidar_point point(size_t k) {
+    lidar_point p;
+    p.intensity = 0;
+    if (binary()) {
+      const char *record = &data[k * h->point_size];
+      p.x = binary_field_value(*h, record, fields[0]);
+      p.y = binary_field_value(*h, record, fields[1]);
+      p.z = binary_field_value(*h, record, fields[2]);
+    } else {
+      tokenize(lines[k], starts, lengths);
+      float *xyz[3] = {&p.x, &p.y, &p.z};
+      for (int i = 0; i < 3; i++) {
+        *xyz[i] = (columns[i] < (int) starts.size()) ? strtod(lines[k].c_str() + starts[columns[i]], NULL) : 0;
+      }
+    }
+    return p;
+  }
+
+  void set_point(size_t k, const lidar_point &p) {
+    double xyz[3] = {p.x, p.y, p.z};
+    if (binary()) {
+      char *record = &data[k * h->point_size];
+      for (int i = 0; i < 3; i++) set_binary_field_value(*h, record, fields[i], xyz[i]);
+      return;
+    }
+    // rebuild the line from the last token back, so earlier offsets stay valid
+    tokenize(lines[k], starts, lengths);
+    int order[3] = {0, 1, 2};
+    std::sort(order, order + 3, [this](int a, int b) { return columns[a] > columns[b]; });
+    char buf[32];
+    for (int j = 0; j < 3; j++) {
+      int i = order[j];
+      if (columns[i] >= (int) starts.size()) continue;
+      snprintf(buf, sizeof(buf), "%.8g", xyz[i]);
+      lines[k].replace(starts[columns[i]], lengths[columns[i]], buf);
+    }
+  }
+
+  bool write(std::ostream &os) const {
+    if (binary()) {
+      os.write(data.data(), data.size());
+    } else {
+      for (std::string const &line : lines) os << line << "\n";
+    }
+    return (bool) os;
+  }
+};
+
+/****************************************/
+/*          Ground Raster Files         */
+/****************************************/
+
+/* A grid and its floor height per cell, to flatten later clouds against
+ * without binning them first. Text: one header line, then a row per line. */
+
+inline bool write_ground_raster(std::string filename, grid &pcl_grid, const std::vector<float> &floor_zs) {
+  std::ofstream ofs(filename);
+  ofs << "FLATTEN_GROUND 1 " << std::setprecision(9) << pcl_grid.s() << " " << pcl_grid.origin_x() << " "
+      << pcl_grid.origin_y() << " " << pcl_grid.h() << " " << pcl_grid.w() << "\n";
+  for (int y = 0; y < pcl_grid.h(); y++) {
+    for (int x = 0; x < pcl_grid.w(); x++) {
+      ofs << (x ? " " : "") << floor_zs[y * pcl_grid.w() + x];
+    }
+    ofs << "\n";
+  }
+  ofs.close();
+  return (bool) ofs;
+}
+
+/* Sets pcl_grid's cell size and window and floor_zs; false if malformed */
+inline bool read_ground_raster(std::string filename, grid &pcl_grid, std::vector<float> &floor_zs) {
+  std::ifstream ifs(filename);
+  std::string magic;
+  int version, h, w;
+  float s, x0, y0;
+  if (!(ifs >> magic >> version >> s >> x0 >> y0 >> h >> w) || magic != "FLATTEN_GROUND" || version != 1
+      || s <= 0 || h <= 0 || w <= 0) {
+    return false;
+  }
+  floor_zs.resize((size_t) h * w);
+  for (float &z : floor_zs) {
+    if (!(ifs >> z)) return false;
+  }
+  pcl_grid = grid(s);
+  pcl_grid.set_window(x0, y0, h, w);
+  return true;
+}
+
+#endif // PCD_STREAM_H
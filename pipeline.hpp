@@ -0,0 +1,257 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <algorithm> // std::copy, std::fill
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+#include "flatten.hpp"
+#include "grid.hpp"
+#include "ground_cache.hpp" // ground_raster
+#include "ground_labels.hpp"
+#include "ground_plane.hpp"
+#include "morton.hpp"
+#include "quantized.hpp"
+#include "scratch_arena.hpp"
+
+/* The per-cloud flattening pipeline of new_flatten_pcl, on any container of
+ * points: optional Morton sort, binning, ground model, adjust and write-back
+ * with ground labels. It takes no PCL types, so the regression test runs
+ * the same code as the tool, with the tool's tunables passed in as
+ * pipeline_settings instead of read from its constants. */
+
+struct pipeline_settings {
+  unsigned int min_points_per_block;
+  bool spatial_sort;        // process points in Morton order of grid cells
+  bool restore_input_order; // write them back in input order (with spatial_sort)
+  bool plane_ground_model;  // robust plane per cell instead of a percentile height
+  bool compact_points;      // bin a fixed-point copy of the points instead of a float copy
+  float compact_precision;  // metres per fixed-point unit; floors are within half of this
+  bool morton_output;       // compute the Morton order anyway, for the output (columnar)
+  float label_height;       // metres; flattened points below this are labelled ground
+};
+
+// Debugging output of the binned grid
+template <typename PointT>
+void print_grid(grid &pcl_grid, flatten_scratch<PointT> &scratch, std::ostream &log) {
+  log << "Grid blocks' sizes:" << std::endl;
+  for (int col = 0; col < pcl_grid.h(); col++) {
+    for (int row = 0; row < pcl_grid.w(); row++) {
+      int c = col * pcl_grid.w() + row;
+      log << std::setw(8) << scratch.cell_starts[c + 1] - scratch.cell_starts[c] << " ";
+    }
+    log << std::endl;
+  }
+  log << "Ground zs:" << std::endl;
+  for (int col = 0; col < pcl_grid.h(); col++) {
+    for (int row = 0; row < pcl_grid.w(); row++) {
+      log << std::setw(7) << std::setprecision(4) << scratch.floor_zs[col * pcl_grid.w() + row] << " ";
+    }
+    log << std::endl;
+  }
+}
+
+// Load a cached ground raster into the buffers the adjust passes read
+template <typename PointT>
+void use_ground_raster(const ground_raster &ground, flatten_scratch<PointT> &scratch) {
+  scratch.fit(scratch.floor_zs, ground.floor_zs.size());
+  std::copy(ground.floor_zs.begin(), ground.floor_zs.end(), scratch.floor_zs.begin());
+  scratch.fit(scratch.planes, ground.planes.size());
+  std::copy(ground.planes.begin(), ground.planes.end(), scratch.planes.begin());
+}
+
+// Flatten the points working on float copies of them.
+// The stages below take the floor from ground instead when it is given, and
+// label the ground points in labels (zeroed, by point index) when it is given.
+template <typename Options, typename PointContainer, typename PointT>
+void flatten_points(PointContainer &cloud_points, grid &pcl_grid, const ground_raster *ground, uint8_t *labels,
+                    flatten_scratch<PointT> &scratch, const pipeline_settings &settings, int num_threads,
+                    std::ostream &log) {
+  size_t num_points = cloud_points.size();
+  int num_cells = pcl_grid.h() * pcl_grid.w();
+  std::vector<uint32_t> &order = scratch.order;
+  std::vector<PointT> &points = scratch.points;
+  scratch.fit(points, num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    points[i] = cloud_points[settings.spatial_sort ? order[i] : i];
+  }
+
+  if (ground) {
+    use_ground_raster(*ground, scratch);
+  } else {
+    // Divide up the z's into grid blocks
+    if (Options::verbose) log << "Placing z's into grid blocks..." << std::endl;
+    scratch.fit(scratch.cell_ids, num_points);
+    scratch.fit(scratch.cell_starts, num_cells + 1);
+    compute_cell_ids(points, pcl_grid, scratch.cell_ids);
+    if (settings.plane_ground_model) {
+      scratch.fit(scratch.cell_points, num_points);
+      bin_point_ids(scratch.cell_ids, num_cells, scratch.cell_starts, scratch.cell_points);
+    } else {
+      scratch.fit(scratch.cell_zs, num_points);
+      bin_zs(points, scratch.cell_ids, num_cells, scratch.cell_starts, scratch.cell_zs);
+    }
+
+    // Compute floor z (or floor plane) for each block
+    if (Options::verbose) log << "Computing ground height per block..." << std::endl;
+    scratch.fit(scratch.floor_zs, num_cells);
+    if (settings.plane_ground_model) {
+      scratch.fit(scratch.planes, num_cells);
+      scratch.fit_plane_buffers(num_threads);
+      fit_ground_planes(points, scratch.cell_starts, scratch.cell_points, pcl_grid, settings.min_points_per_block,
+                        num_threads, scratch.plane_buffers, scratch.planes);
+      for (int c = 0; c < num_cells; c++) scratch.floor_zs[c] = scratch.planes[c].z0;
+    } else {
+      compute_floor_zs(scratch.cell_starts, scratch.cell_zs, settings.min_points_per_block, scratch.floor_zs);
+    }
+    if (Options::verbose) print_grid(pcl_grid, scratch, log);
+  }
+
+  // Adjust each point based on floor height and angle with floor
+  if (Options::verbose) log << "Adjusting all points..." << std::endl;
+  if (settings.plane_ground_model) {
+    adjust_points<Options>(points, pcl_grid, scratch.planes);
+  } else {
+    adjust_points<Options>(points, pcl_grid, scratch.floor_zs);
+  }
+
+  // Write points back to the cloud's points, labelling them on the way
+  bool restore = settings.spatial_sort && settings.restore_input_order;
+  for (size_t i = 0; i < num_points; i++) {
+    size_t dst = restore ? order[i] : i;
+    cloud_points[dst] = points[i];
+    if (labels && points[i].z < settings.label_height) set_ground_label(labels, dst);
+  }
+}
+
+// Percentile-model flattening that bins a compact fixed-point copy of the
+// points (in Morton order with spatial_sort) instead of a float copy, then
+// adjusts the cloud in place, in input order, from its own coordinates, so
+// nothing is decoded or written back. Returns false, having changed nothing,
+// if the points do not fit in fixed point at the precision.
+template <typename Options, typename PointContainer, typename PointT>
+bool flatten_compact_points(PointContainer &cloud_points, grid &pcl_grid, const ground_raster *ground,
+                            uint8_t *labels, flatten_scratch<PointT> &scratch, const pipeline_settings &settings,
+                            std::ostream &log) {
+  size_t num_points = cloud_points.size();
+  int num_cells = pcl_grid.h() * pcl_grid.w();
+  if (ground) {
+    use_ground_raster(*ground, scratch);
+  } else {
+    quantizer q(pcl_grid, settings.compact_precision);
+    std::vector<compact_point> &points = scratch.compact_points;
+    scratch.fit(points, num_points);
+    if (!encode_points(cloud_points, settings.spatial_sort ? scratch.order.data() : NULL, q, points)) return false;
+
+    // Bin and take floor percentiles in fixed-point units, then convert to metres
+    if (Options::verbose) log << "Placing z's into grid blocks..." << std::endl;
+    scratch.fit(scratch.cell_ids, num_points);
+    scratch.fit(scratch.cell_starts, num_cells + 1);
+    scratch.fit(scratch.cell_zs, num_points);
+    compute_cell_ids(points, q, pcl_grid, scratch.cell_ids);
+    bin_zs(points, scratch.cell_ids, num_cells, scratch.cell_starts, scratch.cell_zs);
+    if (Options::verbose) log << "Computing ground height per block..." << std::endl;
+    scratch.fit(scratch.floor_zs, num_cells);
+    compute_floor_zs(scratch.cell_starts, scratch.cell_zs, settings.min_points_per_block, scratch.floor_zs);
+    q.floor_units_to_metres(scratch.floor_zs);
+    if (Options::verbose) print_grid(pcl_grid, scratch, log);
+  }
+
+  if (Options::verbose) log << "Adjusting all points..." << std::endl;
+  for (size_t i = 0; i < num_points; i++) {
+    adjust_point_in_grid<Options>(&cloud_points[i], pcl_grid, scratch.floor_zs);
+    if (labels && cloud_points[i].z < settings.label_height) set_ground_label(labels, i);
+  }
+  return true;
+}
+
+// Height-only flattening, in place: only z is rewritten, so x, y and every
+// other field stay in the cloud as read and there is no working copy
+template <typename Options, typename PointContainer, typename PointT>
+void flatten_heights(PointContainer &cloud_points, grid &pcl_grid, const ground_raster *ground, uint8_t *labels,
+                     flatten_scratch<PointT> &scratch, const pipeline_settings &settings, std::ostream &log) {
+  size_t num_points = cloud_points.size();
+  int num_cells = pcl_grid.h() * pcl_grid.w();
+  if (ground) {
+    use_ground_raster(*ground, scratch);
+  } else {
+    if (Options::verbose) log << "Placing z's into grid blocks..." << std::endl;
+    scratch.fit(scratch.cell_ids, num_points);
+    scratch.fit(scratch.cell_starts, num_cells + 1);
+    scratch.fit(scratch.cell_zs, num_points);
+    compute_cell_ids(cloud_points, pcl_grid, scratch.cell_ids);
+    bin_zs(cloud_points, scratch.cell_ids, num_cells, scratch.cell_starts, scratch.cell_zs);
+    if (Options::verbose) log << "Computing ground height per block..." << std::endl;
+    scratch.fit(scratch.floor_zs, num_cells);
+    compute_floor_zs(scratch.cell_starts, scratch.cell_zs, settings.min_points_per_block, scratch.floor_zs);
+    if (Options::verbose) print_grid(pcl_grid, scratch, log);
+  }
+  if (Options::verbose) log << "Subtracting floor heights..." << std::endl;
+  scratch.fit(scratch.floor_raster, (pcl_grid.h() + 2) * (pcl_grid.w() + 2));
+  subtract_floor_heights(cloud_points, pcl_grid, scratch.floor_zs, scratch.floor_raster, labels,
+                         settings.label_height);
+}
+
+// Flatten a batch of points streamed against a fixed ground (pipe mode with
+// --ground), with the same passes as flatten_cloud: the height kernel when
+// only the floor height is subtracted (raster is floor_zs padded by
+// pad_floor_raster), the full adjust otherwise. Labels the ground points in
+// labels (zeroed, by batch index) when it is given.
+template <typename Options, typename PointContainer>
+void flatten_batch(PointContainer &batch, grid &pcl_grid, const std::vector<float> &floor_zs,
+                   const std::vector<float> &raster, uint8_t *labels, float label_height) {
+  if (!Options::adjust_slope) {
+    subtract_raster_heights(batch, pcl_grid, raster, labels, label_height);
+    return;
+  }
+  adjust_points<Options>(batch, pcl_grid, floor_zs);
+  for (size_t k = 0; labels && k < batch.size(); k++) {
+    if (batch[k].z < label_height) set_ground_label(labels, k);
+  }
+}
+
+// Flatten the points over pcl_grid, taking the floor from ground when given,
+// and label the ground points in scratch.labels if label_ground. Returns true
+// if the points are left in Morton order (point i is input point
+// scratch.order[i]) rather than in input order.
+template <typename Options, typename PointContainer, typename PointT>
+bool flatten_cloud(PointContainer &cloud_points, grid &pcl_grid, const ground_raster *ground, bool label_ground,
+                   flatten_scratch<PointT> &scratch, const pipeline_settings &settings, int num_threads,
+                   std::ostream &log) {
+  size_t num_points = cloud_points.size();
+
+  // Reorder points by Morton code of their grid cell so the grid passes below
+  // walk cell_zs and floor_zs cell by cell instead of jumping around in scan order
+  // (columnar output also wants Morton order, for tight chunk bboxes).
+  // The height-only pass works in place in input order.
+  bool heights_only = !Options::adjust_slope && !settings.plane_ground_model;
+  if ((settings.spatial_sort && !heights_only) || settings.morton_output) {
+    if (Options::verbose) log << "Sorting points by grid cell..." << std::endl;
+    scratch.fit_morton(num_points, num_threads);
+    morton_order(cloud_points, pcl_grid, scratch.order, num_threads, scratch.morton_keys, scratch.radix);
+  }
+
+  uint8_t *labels = NULL;
+  if (label_ground) {
+    scratch.fit(scratch.labels, ground_label_bytes(num_points));
+    std::fill(scratch.labels.begin(), scratch.labels.end(), 0);
+    labels = scratch.labels.data();
+  }
+  if (heights_only) {
+    flatten_heights<Options>(cloud_points, pcl_grid, ground, labels, scratch, settings, log);
+    return false;
+  }
+  if (settings.compact_points && !settings.plane_ground_model) {
+    if (flatten_compact_points<Options>(cloud_points, pcl_grid, ground, labels, scratch, settings, log)) {
+      return false; // adjusted in place
+    }
+    log << "Cloud too large for compact points at " << settings.compact_precision
+        << " m precision, using floats" << std::endl;
+  }
+  flatten_points<Options>(cloud_points, pcl_grid, ground, labels, scratch, settings, num_threads, log);
+  return settings.spatial_sort && !settings.restore_input_order;
+}
+
+#endif // PIPELINE_H
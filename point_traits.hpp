@@ -0,0 +1,39 @@
+#ifndef POINT_TRAITS_H
+#define POINT_TRAITS_H
+
+#include <cstdint>
+
+/* What the flattening stages need to know about a point type beyond its
+ * x, y and z members: the PCD fields it carries besides x y z, how to fill
+ * them from a decoded record, and its intensity (0 if it has none).
+ *
+ * The primary template fits any struct with a numeric intensity member
+ * (lidar_point, pcl::PointXYZI). Specialize it for other point types; a file
+ * is read as a given type when its FIELDS header has all of that type's fields.
+ * A packed field (like PCL's float "rgb", which holds 4 colour bytes) is set
+ * from its raw 32 bits with set_packed_field instead of from a number, so no
+ * float conversion can change them. */
+template <typename PointT>
+struct point_traits {
+  static const int num_fields = 1;
+
+  static const char *field(int /* i */) {
+    return "intensity";
+  }
+
+  static bool packed(int /* i */) {
+    return false;
+  }
+
+  static void set_field(PointT &p, int /* i */, double v) {
+    p.intensity = v;
+  }
+
+  static void set_packed_field(PointT & /* p */, int /* i */, uint32_t /* bits */) {}
+
+  static float intensity(const PointT &p) {
+    return p.intensity;
+  }
+};
+
+#endif // POINT_TRAITS_H
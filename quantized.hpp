@@ -0,0 +1,97 @@
+#ifndef QUANTIZED_H
+#define QUANTIZED_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "dispatch.h"
+#include "grid.hpp"
+#include "util.h"
+
+/* Compact working copy of a point for binning: fixed-point coordinates,
+ * x and y relative to the grid origin. 12 bytes, against 32 for a padded
+ * pcl::PointXYZI. Intensity and the other fields are not copied: the
+ * cloud keeps them, and the adjust pass works on the cloud itself. */
+struct compact_point {
+  int32_t x, y, z;
+};
+
+/* Maps float coordinates to compact_point over a grid. Every encoded
+ * coordinate is within precision/2 of the input, and rounding keeps the
+ * order of z's, so a floor percentile taken in fixed point is the float
+ * floor rounded to the precision. */
+class quantizer {
+
+  private:
+  double origin_x, origin_y;
+  double step;        // metres per fixed-point unit
+  int32_t cell_units; // grid cell side length in fixed-point units
+
+  static bool in_range(double v) {
+    return v > -2147483647.0 && v < 2147483647.0;
+  }
+
+  public:
+
+  quantizer(grid &pcl_grid, float precision) {
+    this->origin_x = pcl_grid.origin_x();
+    this->origin_y = pcl_grid.origin_y();
+    this->step = precision;
+    this->cell_units = (int32_t) std::lround(pcl_grid.s() / precision);
+  }
+
+  float precision() {
+    return this->step;
+  }
+
+  /* Returns false if the point is not representable at this precision */
+  bool encode(float x, float y, float z, compact_point *cp) {
+    double ux = std::nearbyint((x - origin_x) / step);
+    double uy = std::nearbyint((y - origin_y) / step);
+    double uz = std::nearbyint(z / step);
+    if (!in_range(ux) || !in_range(uy) || !in_range(uz)) return false;
+    cp->x = (int32_t) ux;
+    cp->y = (int32_t) uy;
+    cp->z = (int32_t) uz;
+    return true;
+  }
+
+  /* Grid cell of a compact point, using integer division only */
+  uint32_t cell_id(const compact_point &cp, int h, int w) {
+    int y_idx = int_clamp(cp.y / cell_units, 0, h - 1);
+    int x_idx = int_clamp(cp.x / cell_units, 0, w - 1);
+    return y_idx * w + x_idx;
+  }
+
+  /* Convert floor heights computed on fixed-point z's back to metres */
+  void floor_units_to_metres(std::vector<float> &floor_zs) {
+    for (float &z : floor_zs) {
+      z = (float) (z * step);
+    }
+  }
+};
+
+/* Encode points (point order[i] as compact point i, if order is given) into
+ * compact, sized by the caller. Returns false if any point is out of range. */
+template <typename PointContainer>
+bool encode_points(const PointContainer &points, const uint32_t *order, quantizer &q,
+                   std::vector<compact_point> &compact) {
+  bool fits = true;
+  for (size_t i = 0; i < compact.size(); i++) {
+    auto const &p = points[order ? order[i] : i];
+    fits &= q.encode(p.x, p.y, p.z, &compact[i]);
+  }
+  return fits;
+}
+
+/* Grid cell of each compact point */
+HOT_KERNEL inline void compute_cell_ids(const std::vector<compact_point> &points, quantizer &q, grid &pcl_grid,
+                                        std::vector<uint32_t> &cell_ids) {
+  cell_ids.resize(points.size());
+  for (size_t i = 0; i < points.size(); i++) {
+    cell_ids[i] = q.cell_id(points[i], pcl_grid.h(), pcl_grid.w());
+  }
+}
+
+#endif // QUANTIZED_H
@@ -0,0 +1,262 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <algorithm> // std::stable_partition, std::remove_if
+#include <cmath>
+#include <cstdio> // std::remove
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "aux_types.h"
+#include "columnar.hpp" // put_raw, get_raw, bbox_overlaps
+#include "util.h" // int_clamp
+#include "grid.hpp"
+#include "journal.hpp" // partial_filename, commit_partial_file
+#include "pcd_io.hpp"
+
+/* Spatial chunk index for region-of-interest reads of a PCD file.
+ *
+ * The first region query on a file reads it once, splits its points into
+ * runs of PCD_INDEX_CHUNK_POINTS consecutive records and records each run's
+ * byte offset and bbox. The index is cached next to the file as
+ * <file>.idx and reused while the file's size and mtime are unchanged.
+ * Later queries read only the runs whose bbox overlaps the query. Runs are
+ * tight when the file is in scan or Morton order, loose for shuffled files.
+ * binary_compressed files cannot be read by run and are not indexed: the
+ * caller reads them whole and crops them instead (see crop_region_points). */
+
+const uint32_t PCD_INDEX_VERSION = 1;
+const int PCD_INDEX_CHUNK_POINTS = 4096;
+
+struct pcd_chunk {
+  uint64_t offset;     // byte offset of the first record
+  uint32_t num_points;
+  uint32_t num_bytes;
+  bbox box;
+};
+
+struct pcd_index {
+  uint64_t file_size;
+  int64_t mtime;
+  bbox full_box;       // compute_full_bbox of the whole file, for grid alignment
+  std::vector<pcd_chunk> chunks;
+};
+
+/****************************************/
+/*        Building and Caching          */
+/****************************************/
+
+inline std::string pcd_index_filename(std::string filename) {
+  return filename + ".idx";
+}
+
+inline void extend_bbox(bbox &b, float x, float y) {
+  if (x < b.minx) b.minx = x;
+  if (y < b.miny) b.miny = y;
+  if (x > b.maxx) b.maxx = x;
+  if (y > b.maxy) b.maxy = y;
+}
+
+/* Read the whole file once and record its chunks; returns false if it cannot be indexed */
+inline bool build_pcd_index(std::string filename, pcd_index &index) {
+  std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+  pcd_header h;
+  pcd_point_decoder<lidar_point> decoder;
+  if (!ifs || !read_pcd_header(ifs, h) || !decoder.init(h)) return false;
+  if (h.data != "ascii" && h.data != "binary") return false;
+  uint64_t offset = ifs.tellg();
+  index.full_box = bbox{0, 0, 0, 0};
+  index.chunks.clear();
+  std::vector<char> record(h.point_size);
+  std::string line;
+  lidar_point p;
+  pcd_chunk chunk;
+  chunk.num_points = 0;
+  for (size_t i = 0; i < h.points; i++) {
+    uint64_t record_offset = offset;
+    if (h.data == "binary") {
+      if (!ifs.read(record.data(), h.point_size)) break;
+      decoder.decode_binary(h, record.data(), p);
+      offset += h.point_size;
+    } else {
+      if (!std::getline(ifs, line)) break;
+      offset += line.size() + 1;
+      if (!decoder.decode_ascii(line, p)) return false;
+    }
+    if (chunk.num_points == 0) {
+      chunk.offset = record_offset;
+      chunk.num_bytes = 0;
+      chunk.box = bbox{p.x, p.y, p.x, p.y};
+    }
+    extend_bbox(chunk.box, p.x, p.y);
+    extend_bbox(index.full_box, p.x, p.y);
+    chunk.num_points++;
+    chunk.num_bytes = offset - chunk.offset;
+    if (chunk.num_points == (uint32_t) PCD_INDEX_CHUNK_POINTS) {
+      index.chunks.push_back(chunk);
+      chunk.num_points = 0;
+    }
+  }
+  if (chunk.num_points > 0) index.chunks.push_back(chunk);
+  index.file_size = boost::filesystem::file_size(filename);
+  index.mtime = boost::filesystem::last_write_time(filename);
+  return true;
+}
+
+/* Write the index next to filename, atomically (a reader never sees half of
+ * it); returns false if it cannot be written, e.g. in a read-only directory */
+inline bool save_pcd_index(std::string filename, const pcd_index &index) {
+  std::string buf = "FIDX";
+  put_raw<uint32_t>(buf, PCD_INDEX_VERSION);
+  put_raw<uint64_t>(buf, index.file_size);
+  put_raw<int64_t>(buf, index.mtime);
+  put_raw<bbox>(buf, index.full_box);
+  put_raw<uint32_t>(buf, index.chunks.size());
+  for (pcd_chunk const &c : index.chunks) {
+    put_raw<pcd_chunk>(buf, c);
+  }
+  std::string index_filename = pcd_index_filename(filename);
+  std::ofstream ofs(partial_filename(index_filename), std::ios_base::out | std::ios_base::binary);
+  ofs.write(buf.data(), buf.size());
+  ofs.close();
+  if (!ofs.good() || !commit_partial_file(index_filename)) {
+    std::remove(partial_filename(index_filename).c_str());
+    return false;
+  }
+  return true;
+}
+
+/* Load the cached index; returns false if missing, corrupt or stale */
+inline bool load_pcd_index(std::string filename, pcd_index &index) {
+  std::ifstream ifs(pcd_index_filename(filename), std::ios_base::in | std::ios_base::binary);
+  const size_t HEAD_SIZE = 4 + 4 + 8 + 8 + sizeof(bbox) + 4;
+  char head[HEAD_SIZE];
+  if (!ifs || !ifs.read(head, HEAD_SIZE) || memcmp(head, "FIDX", 4) != 0) return false;
+  if (get_raw<uint32_t>(head + 4) != PCD_INDEX_VERSION) return false;
+  index.file_size = get_raw<uint64_t>(head + 8);
+  index.mtime = get_raw<int64_t>(head + 16);
+  index.full_box = get_raw<bbox>(head + 24);
+  boost::system::error_code ec;
+  if (index.file_size != boost::filesystem::file_size(filename, ec) || ec
+      || index.mtime != (int64_t) boost::filesystem::last_write_time(filename, ec) || ec) {
+    return false;
+  }
+  index.chunks.resize(get_raw<uint32_t>(head + 24 + sizeof(bbox)));
+  return (bool) ifs.read((char *) index.chunks.data(), index.chunks.size() * sizeof(pcd_chunk));
+}
+
+/* Load the cached index, or build and cache it on first use. An index that
+ * cannot be cached is still returned, and rebuilt by the next run. */
+inline bool get_pcd_index(std::string filename, pcd_index &index, std::ostream &log) {
+  if (load_pcd_index(filename, index)) return true;
+  if (!build_pcd_index(filename, index)) return false;
+  if (!save_pcd_index(filename, index)) {
+    log << "Couldn't cache the index of " << filename << " as " << pcd_index_filename(filename)
+        << "; it is rebuilt on every run" << std::endl;
+  }
+  return true;
+}
+
+/****************************************/
+/*            Region Reads              */
+/****************************************/
+
+/* Set up region_grid as the window of the whole-file grid that covers roi
+ * plus one cell on every side (clipped to the file), so every cell a roi
+ * point interpolates from is complete and cells line up with a whole-file
+ * run. Returns the bbox of the window, i.e. the points to load. */
+inline bbox region_grid(bbox roi, bbox full_box, grid &region_grid) {
+  float s = region_grid.s();
+  grid full_grid(s);
+  std::pair<int, int> dim = full_grid.compute_grid(full_box);
+  int x0 = int_clamp((int) std::floor((roi.minx - full_box.minx) / s) - 1, 0, dim.second);
+  int y0 = int_clamp((int) std::floor((roi.miny - full_box.miny) / s) - 1, 0, dim.first);
+  int x1 = int_clamp((int) std::floor((roi.maxx - full_box.minx) / s) + 2, x0, dim.second);
+  int y1 = int_clamp((int) std::floor((roi.maxy - full_box.miny) / s) + 2, y0, dim.first);
+  bbox window = bbox{full_box.minx + x0 * s, full_box.miny + y0 * s,
+                     full_box.minx + x1 * s, full_box.miny + y1 * s};
+  region_grid.set_window(window.minx, window.miny, y1 - y0, x1 - x0);
+  return window;
+}
+
+inline bool bbox_contains(const bbox &b, float x, float y) {
+  return x >= b.minx && x < b.maxx && y >= b.miny && y < b.maxy;
+}
+
+/* Append the points inside box, reading only the chunks that overlap it.
+ * Returns the number of chunks read, or -1 on error. */
+template <typename PointContainer>
+int read_pcd_region(std::string filename, const pcd_index &index, bbox box, PointContainer &out) {
+  std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+  pcd_header h;
+  pcd_point_decoder<typename PointContainer::value_type> decoder;
+  if (!ifs || !read_pcd_header(ifs, h) || !decoder.init(h)) return -1;
+  bool binary = (h.data == "binary");
+  std::vector<char> buf;
+  std::string line;
+  typename PointContainer::value_type p = typename PointContainer::value_type();
+  int num_read = 0;
+  for (pcd_chunk const &c : index.chunks) {
+    if (!bbox_overlaps(c.box, box)) continue;
+    buf.resize(c.num_bytes);
+    if (!ifs.seekg(c.offset) || !ifs.read(buf.data(), buf.size())) return -1;
+    if (binary) {
+      for (uint32_t i = 0; i < c.num_points; i++) {
+        decoder.decode_binary(h, &buf[i * h.point_size], p);
+        if (bbox_contains(box, p.x, p.y)) out.push_back(p);
+      }
+    } else {
+      std::istringstream lines(std::string(buf.data(), buf.size()));
+      while (std::getline(lines, line)) {
+        if (decoder.decode_ascii(line, p) && bbox_contains(box, p.x, p.y)) out.push_back(p);
+      }
+    }
+    num_read++;
+  }
+  return num_read;
+}
+
+/* Move the points inside roi to the front, keeping their order; returns their number */
+template <typename PointContainer>
+size_t partition_roi_points(PointContainer &points, bbox roi) {
+  typedef typename PointContainer::value_type PointT;
+  auto roi_end = std::stable_partition(points.begin(), points.end(),
+                                       [&roi](const PointT &p) { return bbox_contains(roi, p.x, p.y); });
+  return roi_end - points.begin();
+}
+
+/* Read the points to flatten roi with: those in the window of the
+ * whole-file grid around it (see region_grid), roi points first, so the
+ * halo can be dropped after flattening. Sets up pcl_grid, *grid_box (the
+ * window) and *num_roi_points. Returns the number of chunks read, or -1. */
+template <typename PointContainer>
+int load_region_points(std::string filename, const pcd_index &index, bbox roi, grid &pcl_grid, bbox *grid_box,
+                       PointContainer &points, size_t *num_roi_points) {
+  points.clear();
+  *grid_box = region_grid(roi, index.full_box, pcl_grid);
+  int chunks_read = read_pcd_region(filename, index, *grid_box, points);
+  if (chunks_read < 0) return -1;
+  *num_roi_points = partition_roi_points(points, roi);
+  return chunks_read;
+}
+
+/* The same, from all of a file's points (full_box as build_pcd_index takes
+ * it): for files that cannot be indexed, such as binary_compressed ones */
+template <typename PointContainer>
+void crop_region_points(PointContainer &points, bbox roi, bbox full_box, grid &pcl_grid, bbox *grid_box,
+                        size_t *num_roi_points) {
+  typedef typename PointContainer::value_type PointT;
+  bbox window = region_grid(roi, full_box, pcl_grid);
+  points.erase(std::remove_if(points.begin(), points.end(),
+                              [&window](const PointT &p) { return !bbox_contains(window, p.x, p.y); }),
+               points.end());
+  *grid_box = window;
+  *num_roi_points = partition_roi_points(points, roi);
+}
+
+#endif // REGION_H
@@ -0,0 +1,88 @@
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+
+#include <algorithm> // std::max
+#include <cstdint>
+#include <vector>
+
+#include "ground_plane.hpp" // ground_plane
+#include "morton.hpp" // radix_sort_buffers
+#include "quantized.hpp" // compact_point
+
+/* Per-worker scratch buffers for flattening one file at a time.
+ * Buffers keep their capacity between files, so after the first few files
+ * they sit at the batch's high-water mark and a file allocates nothing.
+ * Call begin_file() between files; fit() every buffer before a stage uses it. */
+template <typename PointT>
+class flatten_scratch {
+
+  public:
+  std::vector<PointT> points;        // working copy of the cloud (maybe reordered)
+  std::vector<compact_point> compact_points; // same, in fixed-point form, for binning only
+  std::vector<uint32_t> order;       // Morton permutation, order[i] = input index
+  std::vector<uint32_t> morton_keys; // Morton code of each point, for sorting order
+  radix_sort_buffers radix;          // temporaries of the Morton sort
+  std::vector<uint32_t> cell_ids;    // grid cell of each point
+  std::vector<uint32_t> cell_starts; // zs of cell c are cell_zs[cell_starts[c] .. cell_starts[c+1])
+  std::vector<float> cell_zs;        // all z's grouped by grid cell
+  std::vector<uint32_t> cell_points; // point ids grouped by cell (plane ground model, instead of cell_zs)
+  std::vector<float> floor_zs;       // ground height per cell, row major
+  std::vector<float> floor_raster;   // floor_zs with a repeated border, for the height-only kernel
+  std::vector<ground_plane> planes;  // ground plane per cell, row major
+  std::vector<plane_fit_buffers> plane_buffers; // per thread, for fit_ground_planes
+  std::vector<uint8_t> labels;       // ground label bitmask, by point of the cloud (ground_labels.hpp)
+  std::vector<uint8_t> output_labels; // same, in output point order when that differs
+
+  size_t allocations;                // buffer growths since begin_file()
+
+  flatten_scratch() {
+    this->allocations = 0;
+  }
+
+  void begin_file() {
+    this->allocations = 0;
+  }
+
+  /* Size buf to n elements, counting it if that needs a new allocation */
+  template <typename T, typename Alloc>
+  void fit(std::vector<T, Alloc> &buf, size_t n) {
+    if (buf.capacity() < n) this->allocations++;
+    buf.resize(n);
+  }
+
+  /* Size the Morton sort's buffers for n points sorted on num_threads threads */
+  void fit_morton(size_t n, int num_threads) {
+    fit(order, n);
+    fit(morton_keys, n);
+    fit(radix.keys_tmp, n);
+    fit(radix.values_tmp, n);
+    fit(radix.offsets, (size_t) std::max(num_threads, 1) * RADIX_SORT_BUCKETS);
+  }
+
+  /* Size the plane fit buffers of num_threads threads for the largest fit */
+  void fit_plane_buffers(int num_threads) {
+    fit(plane_buffers, num_threads);
+    for (plane_fit_buffers &buf : plane_buffers) {
+      fit(buf.xs, GROUND_PLANE_MAX_SAMPLES + 1);
+      fit(buf.ys, GROUND_PLANE_MAX_SAMPLES + 1);
+      fit(buf.zs, GROUND_PLANE_MAX_SAMPLES + 1);
+      fit(buf.sorted, GROUND_PLANE_MAX_SAMPLES + 1);
+    }
+  }
+
+  size_t bytes_reserved() {
+    size_t plane_floats = 0;
+    for (plane_fit_buffers &buf : plane_buffers) {
+      plane_floats += buf.xs.capacity() + buf.ys.capacity() + buf.zs.capacity() + buf.sorted.capacity();
+    }
+    return points.capacity() * sizeof(PointT) + compact_points.capacity() * sizeof(compact_point)
+         + (order.capacity() + morton_keys.capacity() + radix.keys_tmp.capacity() + radix.values_tmp.capacity()
+            + cell_ids.capacity() + cell_starts.capacity() + cell_points.capacity()) * sizeof(uint32_t)
+         + radix.offsets.capacity() * sizeof(size_t)
+         + (cell_zs.capacity() + floor_zs.capacity() + floor_raster.capacity() + plane_floats) * sizeof(float)
+         + planes.capacity() * sizeof(ground_plane) + plane_buffers.capacity() * sizeof(plane_fit_buffers)
+         + labels.capacity() + output_labels.capacity();
+  }
+};
+
+#endif // SCRATCH_ARENA_H
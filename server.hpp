@@ -0,0 +1,306 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <algorithm> // std::nth_element
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring> // strncpy
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Plumbing for the flattening server (new_flatten_pcl --serve) and its
+ * client (flatten_client). There is one request per connection: the client
+ * writes a single line of tab-separated fields, e.g.
+ *   flatten <tab> <input.pcd> <tab> <output.pcd> [<tab> minx,miny,maxx,maxy]
+ *   stats
+ *   shutdown
+ * and reads the reply, whose first line starts with "ok" or "error", until
+ * the server closes the connection. */
+
+const size_t MAX_REQUEST_BYTES = 65536;
+const int REQUEST_TIMEOUT_MS = 5000; // for a client to send its request line once connected
+
+/****************************************/
+/*            Unix Sockets              */
+/****************************************/
+
+inline bool unix_socket_address(std::string path, struct sockaddr_un *addr) {
+  if (path.size() >= sizeof(addr->sun_path)) return false;
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, path.c_str(), sizeof(addr->sun_path) - 1);
+  return true;
+}
+
+/* Connected socket to the server at path, or -1 */
+inline int connect_unix_socket(std::string path) {
+  struct sockaddr_un addr;
+  if (!unix_socket_address(path, &addr)) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Listening socket at path, replacing a stale socket file left by a server
+ * that died, or -1 (also if a live server is already listening there) */
+inline int listen_unix_socket(std::string path) {
+  struct sockaddr_un addr;
+  if (!unix_socket_address(path, &addr)) return -1;
+  int live = connect_unix_socket(path);
+  if (live >= 0) {
+    close(live);
+    return -1;
+  }
+  unlink(path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+inline bool set_nonblocking(int fd, bool nonblocking) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0) return false;
+  return fcntl(fd, F_SETFL, nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) == 0;
+}
+
+inline bool write_all(int fd, std::string s) {
+  size_t written = 0;
+  while (written < s.size()) {
+    ssize_t n = write(fd, s.data() + written, s.size() - written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    written += n;
+  }
+  return true;
+}
+
+inline std::vector<std::string> split_fields(std::string line) {
+  std::vector<std::string> fields;
+  size_t begin = 0;
+  for (size_t end = line.find('\t'); end != std::string::npos; end = line.find('\t', begin)) {
+    fields.push_back(line.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  fields.push_back(line.substr(begin));
+  return fields;
+}
+
+/****************************************/
+/*         Requests and Stats           */
+/****************************************/
+
+struct server_request {
+  int fd;                           // connection to reply on
+  std::vector<std::string> fields;  // request line
+  std::chrono::steady_clock::time_point arrival;
+};
+
+/* Connections whose request line is still arriving. The accepting thread
+ * reads them as their bytes come in, alongside new connections, and only
+ * queues complete requests, so a slow or silent client holds up neither
+ * the next connection nor a worker. */
+class request_reader {
+
+  private:
+  struct connection {
+    server_request r;
+    std::string line;
+  };
+  std::vector<connection> connections;
+
+  /* Read what has arrived on c; returns false once it is complete (queued
+   * on ready) or given up on (closed) */
+  static bool read_some(connection &c, std::vector<server_request> &ready) {
+    char buf[4096];
+    for (;;) {
+      ssize_t n = read(c.r.fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+      if (n <= 0) break; // EOF or error before a whole line
+      c.line.append(buf, n);
+      size_t newline = c.line.find('\n', c.line.size() - n);
+      if (newline != std::string::npos) {
+        if (newline > MAX_REQUEST_BYTES || !set_nonblocking(c.r.fd, false)) break;
+        c.r.fields = split_fields(c.line.substr(0, newline));
+        ready.push_back(c.r);
+        return false;
+      }
+      if (c.line.size() > MAX_REQUEST_BYTES) break;
+    }
+    close(c.r.fd);
+    return false;
+  }
+
+  public:
+
+  ~request_reader() {
+    for (connection const &c : connections) close(c.r.fd);
+  }
+
+  void add(int fd) {
+    connection c;
+    c.r.fd = fd;
+    c.r.arrival = std::chrono::steady_clock::now();
+    if (!set_nonblocking(fd, true)) {
+      close(fd);
+      return;
+    }
+    connections.push_back(c);
+  }
+
+  /* Wait for a new connection on listen_fd or request bytes, appending the
+   * requests completed to ready and closing connections that time out.
+   * Returns listen_fd's poll events (0 if none). */
+  short poll_once(int listen_fd, std::vector<server_request> &ready) {
+    std::vector<struct pollfd> fds(1 + connections.size());
+    fds[0] = {listen_fd, POLLIN, 0};
+    for (size_t i = 0; i < connections.size(); i++) fds[i + 1] = {connections[i].r.fd, POLLIN, 0};
+    int timeout = connections.empty() ? -1 : 100; // ms, to expire silent connections
+    if (poll(fds.data(), fds.size(), timeout) < 0) return 0;
+    auto now = std::chrono::steady_clock::now();
+    size_t kept = 0;
+    for (size_t i = 0; i < connections.size(); i++) {
+      connection &c = connections[i];
+      bool open = fds[i + 1].revents ? read_some(c, ready) : true;
+      if (open && now - c.r.arrival > std::chrono::milliseconds(REQUEST_TIMEOUT_MS)) {
+        close(c.r.fd);
+        open = false;
+      }
+      if (open) connections[kept++] = c;
+    }
+    connections.resize(kept);
+    return fds[0].revents;
+  }
+};
+
+/* Connections waiting for a free worker, first come first served */
+class request_queue {
+
+  private:
+  std::deque<server_request> requests;
+  bool closed;
+  std::mutex m;
+  std::condition_variable cv;
+
+  public:
+
+  request_queue() : closed(false) {}
+
+  void push(server_request r) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      requests.push_back(r);
+    }
+    cv.notify_one();
+  }
+
+  /* Wait for the next request; false once closed and drained */
+  bool pop(server_request *r) {
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [this] { return closed || !requests.empty(); });
+    if (requests.empty()) return false;
+    *r = requests.front();
+    requests.pop_front();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      closed = true;
+    }
+    cv.notify_all();
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(m);
+    return requests.size();
+  }
+};
+
+/* Counts of jobs and the latencies of the last LATENCY_WINDOW finished ones */
+class server_stats {
+
+  private:
+  static const size_t LATENCY_WINDOW = 1024;
+  size_t completed, failed;
+  int running;
+  std::vector<double> wait_ms, total_ms; // ring buffers
+  size_t next;
+  std::chrono::steady_clock::time_point start_time;
+  std::mutex m;
+
+  static std::string percentiles(std::vector<double> ms) {
+    std::ostringstream oss;
+    if (ms.empty()) return "p50 0 p90 0 p99 0 max 0";
+    const double ps[] = {0.5, 0.9, 0.99, 1.0};
+    const char *names[] = {"p50", "p90", "p99", "max"};
+    for (int i = 0; i < 4; i++) {
+      std::vector<double>::iterator nth = ms.begin() + (size_t) (ps[i] * (ms.size() - 1));
+      std::nth_element(ms.begin(), nth, ms.end());
+      oss << (i ? " " : "") << names[i] << " " << *nth;
+    }
+    return oss.str();
+  }
+
+  public:
+
+  server_stats() : completed(0), failed(0), running(0), next(0),
+                   start_time(std::chrono::steady_clock::now()) {}
+
+  void job_started() {
+    std::lock_guard<std::mutex> lock(m);
+    running++;
+  }
+
+  /* wait = time queued, total = arrival to reply, both in ms */
+  void job_finished(bool ok, double wait, double total) {
+    std::lock_guard<std::mutex> lock(m);
+    running--;
+    (ok ? completed : failed)++;
+    if (wait_ms.size() < LATENCY_WINDOW) {
+      wait_ms.push_back(wait);
+      total_ms.push_back(total);
+    } else {
+      wait_ms[next] = wait;
+      total_ms[next] = total;
+    }
+    next = (next + 1) % LATENCY_WINDOW;
+  }
+
+  /* One "name value..." line per stat */
+  std::string report(size_t queued, int num_workers) {
+    std::lock_guard<std::mutex> lock(m);
+    std::ostringstream oss;
+    oss << "queued " << queued << "\n"
+        << "running " << running << "\n"
+        << "workers " << num_workers << "\n"
+        << "completed " << completed << "\n"
+        << "failed " << failed << "\n"
+        << "wait_ms " << percentiles(wait_ms) << "\n"
+        << "latency_ms " << percentiles(total_ms) << "\n"
+        << "uptime_s " << (long) std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                               - start_time).count() << "\n";
+    return oss.str();
+  }
+};
+
+#endif // SERVER_H
@@ -0,0 +1,164 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include <algorithm> // std::max
+#include <chrono>
+#include <csignal>
+#include <cstdio> // fflush
+#include <deque>
+#include <iostream>
+#include <new> // std::bad_alloc
+#include <stdexcept>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Runs jobs in a pool of forked worker processes, one job per process, so a
+ * job that crashes, runs out of memory or hangs takes down only itself.
+ * Each process gets an address-space cap and a wall-clock timeout. Crashed,
+ * out-of-memory and timed-out jobs are retried (at the back of the queue,
+ * so the rest of the batch keeps going) up to max_attempts times; jobs that
+ * fail cleanly are not retried. */
+
+enum job_outcome {
+  JOB_DONE,
+  JOB_FAILED,        // the job returned an error
+  JOB_OUT_OF_MEMORY, // allocation failed under the memory cap
+  JOB_TIMED_OUT,     // killed after timeout_secs
+  JOB_CRASHED        // killed by any other signal
+};
+
+// Exit codes of a job process
+const int JOB_EXIT_DONE = 0;
+const int JOB_EXIT_FAILED = 1;
+const int JOB_EXIT_OUT_OF_MEMORY = 3;
+
+struct supervisor_limits {
+  int num_procs;        // worker processes at once
+  size_t max_memory_mb; // per-process address space cap (0 = none)
+  double timeout_secs;  // per attempt (0 = none)
+  int max_attempts;     // attempts per job before it is given up on
+};
+
+struct job_report {
+  size_t job;
+  job_outcome outcome; // of the last attempt
+  int attempts;
+  double seconds;      // of the last attempt
+};
+
+inline const char *job_outcome_str(job_outcome outcome) {
+  switch (outcome) {
+    case JOB_DONE: return "done";
+    case JOB_FAILED: return "failed";
+    case JOB_OUT_OF_MEMORY: return "out of memory";
+    case JOB_TIMED_OUT: return "timed out";
+    default: return "crashed";
+  }
+}
+
+/* Apply the memory cap in a job process. Linux does not enforce RLIMIT_RSS,
+ * so the cap is on address space, which bounds resident memory too. */
+inline void apply_memory_cap(size_t max_memory_mb) {
+  if (max_memory_mb == 0) return;
+  struct rlimit limit;
+  limit.rlim_cur = limit.rlim_max = (rlim_t) max_memory_mb << 20;
+  setrlimit(RLIMIT_AS, &limit);
+}
+
+/* Body of a job process: the job's exit code, with failed allocations
+ * and exceptions mapped to their own codes */
+template <typename Job>
+int run_job_process(Job &job, size_t i) {
+  int code;
+  try {
+    code = job(i) ? JOB_EXIT_DONE : JOB_EXIT_FAILED;
+  } catch (std::bad_alloc &) {
+    code = JOB_EXIT_OUT_OF_MEMORY;
+  } catch (std::exception &e) {
+    std::cout << "Error: " << e.what() << std::endl;
+    code = JOB_EXIT_FAILED;
+  }
+  std::cout.flush();
+  fflush(stdout);
+  return code;
+}
+
+inline job_outcome classify_exit(int status, bool timed_out) {
+  if (timed_out) return JOB_TIMED_OUT;
+  if (WIFEXITED(status)) {
+    if (WEXITSTATUS(status) == JOB_EXIT_DONE) return JOB_DONE;
+    if (WEXITSTATUS(status) == JOB_EXIT_OUT_OF_MEMORY) return JOB_OUT_OF_MEMORY;
+    return JOB_FAILED;
+  }
+  return JOB_CRASHED;
+}
+
+/* Run job(i) -> bool for every i in [0, num_jobs), in that order, each in
+ * its own forked process, and call on_finish(report) in this process once
+ * per job with its final outcome. Must be called while single-threaded. */
+template <typename Job, typename OnFinish>
+void supervise(size_t num_jobs, const supervisor_limits &limits, Job job, OnFinish on_finish) {
+  typedef std::chrono::steady_clock clock;
+  struct running_job {
+    pid_t pid;
+    size_t job;
+    clock::time_point start;
+    bool timed_out;
+  };
+  std::deque<size_t> queue;
+  for (size_t i = 0; i < num_jobs; i++) queue.push_back(i);
+  std::vector<int> attempts(num_jobs, 0);
+  std::vector<running_job> running;
+
+  while (!queue.empty() || !running.empty()) {
+    // fill free slots
+    while ((int) running.size() < std::max(1, limits.num_procs) && !queue.empty()) {
+      size_t i = queue.front();
+      std::cout.flush(); // or the child would print it again
+      pid_t pid = fork();
+      if (pid < 0) break; // out of processes, try again once one finishes
+      if (pid == 0) {
+        apply_memory_cap(limits.max_memory_mb);
+        _exit(run_job_process(job, i));
+      }
+      queue.pop_front();
+      attempts[i]++;
+      running.push_back(running_job{pid, i, clock::now(), false});
+    }
+
+    // reap a finished process, or kill slow ones and wait a little
+    int status;
+    pid_t pid = waitpid(-1, &status, WNOHANG);
+    if (pid <= 0) {
+      for (running_job &r : running) {
+        double secs = std::chrono::duration<double>(clock::now() - r.start).count();
+        if (limits.timeout_secs > 0 && secs > limits.timeout_secs && !r.timed_out) {
+          kill(r.pid, SIGKILL);
+          r.timed_out = true;
+        }
+      }
+      usleep(10000);
+      continue;
+    }
+    for (size_t k = 0; k < running.size(); k++) {
+      if (running[k].pid != pid) continue;
+      running_job r = running[k];
+      running.erase(running.begin() + k);
+      job_outcome outcome = classify_exit(status, r.timed_out);
+      bool retry = (outcome != JOB_DONE && outcome != JOB_FAILED) && attempts[r.job] < limits.max_attempts;
+      if (retry) {
+        queue.push_back(r.job);
+      } else {
+        double secs = std::chrono::duration<double>(clock::now() - r.start).count();
+        on_finish(job_report{r.job, outcome, attempts[r.job], secs});
+      }
+      break;
+    }
+  }
+}
+
+#endif // SUPERVISOR_H
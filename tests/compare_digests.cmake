@@ -0,0 +1,17 @@
+# Fails unless every build in OTHERS (comma-separated) produces outputs
+# bit-identical to BASELINE's (same digest for every case and path)
+execute_process(COMMAND ${BASELINE} ${TESTS_DIR} --digest OUTPUT_VARIABLE baseline RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "${BASELINE} --digest failed:\n${baseline}")
+endif()
+string(REPLACE "," ";" others "${OTHERS}")
+foreach(other ${others})
+  execute_process(COMMAND ${other} ${TESTS_DIR} --digest OUTPUT_VARIABLE digests RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${other} --digest failed:\n${digests}")
+  endif()
+  if(NOT digests STREQUAL baseline)
+    message(FATAL_ERROR "Outputs differ between SIMD levels\n${BASELINE}:\n${baseline}\n${other}:\n${digests}")
+  endif()
+endforeach()
+message(STATUS "All builds agree:\n${baseline}")
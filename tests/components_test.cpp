@@ -0,0 +1,481 @@
+/****************************************/
+/*          Component Checks            */
+/****************************************/
+
+// Checks the parts of new_flatten_pcl around the flattening pipeline, on
+// generated clouds and files in a temporary directory:
+//  - region reads (region.hpp): a roi flattened from the chunks around it
+//    matches the whole-file run inside the roi, and a stale .idx is rebuilt
+//    (one that cannot be written is reported),
+//  - pipe mode (pcd_stream.hpp): binary and ascii records streamed in
+//    batches against a saved ground raster match the whole-cloud run, with
+//    every other field passed through,
+//  - the world ground of --sequence (world_ground.hpp): floors over every
+//    point seen, accumulated over overlapping frames, frozen once saturated,
+//  - the run journal (journal.hpp): which inputs a resumed run skips,
+//  - input discovery (find_input_files): globs, the skipped output
+//    directory, extensions, ordering and output name collisions.
+//
+// Usage: ./components_test
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "aux_types.h"
+#include "grid.hpp"
+#include "util.h"
+#include "flatten.hpp"
+#include "ground_labels.hpp"
+#include "journal.hpp"
+#include "pcd_io.hpp"
+#include "pcd_stream.hpp"
+#include "pipeline.hpp"
+#include "region.hpp"
+#include "scratch_arena.hpp"
+#include "world_ground.hpp"
+#include "test_corpus.hpp"
+
+namespace fs = boost::filesystem;
+
+const float GRID_SIDE_LEN = 20;
+const int MIN_POINTS_PER_BLOCK = 100;
+const float GROUND_LABEL_HEIGHT = 0.2;
+const size_t PIPE_BATCH_POINTS = 1000; // several batches per cloud, the last one partial
+
+typedef flatten_options<true, false> full_options;
+typedef flatten_options<false, false> height_options;
+
+/* new_flatten_pcl's default pipeline settings (see regression_test) */
+const pipeline_settings SCAN_ORDER = {MIN_POINTS_PER_BLOCK, false, true, false, false, 0.001, false,
+                                      GROUND_LABEL_HEIGHT};
+
+int failures = 0;
+
+void report(bool ok, std::string label, std::string detail) {
+  std::cout << (ok ? "ok    " : "FAIL: ") << std::left << std::setw(30) << label << std::right << " "
+            << detail << std::endl;
+  if (!ok) failures++;
+}
+
+/* Flatten points over grid as new_flatten_pcl does by default; sets floor_zs */
+template <typename Options, typename PointT>
+void flatten_over(std::vector<PointT> &points, grid &pcl_grid, std::vector<float> *floor_zs = NULL) {
+  flatten_scratch<PointT> scratch;
+  std::ostringstream log;
+  flatten_cloud<Options>(points, pcl_grid, NULL, false, scratch, SCAN_ORDER, 1, log);
+  if (floor_zs) *floor_zs = scratch.floor_zs;
+}
+
+bool bit_identical(const test_point &a, const test_point &b) {
+  return memcmp(&a, &b, sizeof(test_point)) == 0;
+}
+
+/****************************************/
+/*            Region Reads              */
+/****************************************/
+
+/* A roi of a binary file, read through its chunk index and flattened over
+ * the window of the whole-file grid around it, against the whole file
+ * flattened and cropped to the roi, and against the unindexed fallback (the
+ * whole file cropped before flattening). Then the file is rewritten: its
+ * cached index must be found stale and rebuilt. An index that cannot be
+ * cached is still used, and reported. */
+void check_region(fs::path dir) {
+  cloud points;
+  generate_scan(points, 8 * PCD_INDEX_CHUNK_POINTS);
+  std::string filename = (dir / "region.pcd").string();
+  write_test_pcd(filename, points);
+
+  cloud full = points;
+  grid full_grid(GRID_SIDE_LEN);
+  full_grid.compute_grid(compute_full_bbox(full));
+  flatten_over<full_options>(full, full_grid);
+
+  pcd_index index;
+  std::ostringstream log;
+  bool indexed = get_pcd_index(filename, index, log) && fs::exists(pcd_index_filename(filename))
+                 && !fs::exists(partial_filename(pcd_index_filename(filename))) && log.str().empty();
+  const bbox ROI = {5, -10, 30, 15}; // clear of the chunks at the far end of the route
+  grid region(GRID_SIDE_LEN);
+  bbox grid_box;
+  cloud roi_points;
+  size_t num_roi_points = 0;
+  int chunks_read = indexed ? load_region_points(filename, index, ROI, region, &grid_box, roi_points,
+                                                 &num_roi_points) : -1;
+  flatten_over<full_options>(roi_points, region);
+  cloud cropped = points;
+  grid crop_grid(GRID_SIDE_LEN);
+  bbox crop_box;
+  size_t num_cropped_roi_points = 0;
+  crop_region_points(cropped, ROI, compute_full_bbox(points), crop_grid, &crop_box, &num_cropped_roi_points);
+  flatten_over<full_options>(cropped, crop_grid);
+  bool same_crop = cropped.size() == roi_points.size() && num_cropped_roi_points == num_roi_points
+                   && memcmp(&crop_box, &grid_box, sizeof(bbox)) == 0
+                   && std::equal(cropped.begin(), cropped.end(), roi_points.begin(), bit_identical);
+
+  // the file is in scan order, so the roi's points come back in the same order
+  size_t k = 0, mismatches = 0;
+  for (size_t i = 0; i < points.size(); i++) {
+    if (!bbox_contains(ROI, points[i].x, points[i].y)) continue;
+    if (k >= num_roi_points || !bit_identical(roi_points[k], full[i])) mismatches++;
+    k++;
+  }
+  std::ostringstream detail;
+  detail << k << " points in the roi, " << mismatches << " differ, " << chunks_read << " of "
+         << index.chunks.size() << " chunks read";
+  report(indexed && chunks_read > 0 && chunks_read < (int) index.chunks.size() && num_roi_points == k
+         && mismatches == 0 && same_crop, "region/roi", detail.str());
+
+  // A file of another size under the same name: the cached index is stale
+  points.resize(points.size() - PCD_INDEX_CHUNK_POINTS / 2);
+  write_test_pcd(filename, points);
+  pcd_index cached, rebuilt, expected;
+  bool stale = !load_pcd_index(filename, cached);
+  bool ok = stale && get_pcd_index(filename, rebuilt, log) && build_pcd_index(filename, expected)
+            && load_pcd_index(filename, cached) && rebuilt.chunks.size() == expected.chunks.size()
+            && cached.chunks.size() == expected.chunks.size()
+            && memcmp(&rebuilt.full_box, &expected.full_box, sizeof(bbox)) == 0
+            && rebuilt.file_size == fs::file_size(filename);
+  size_t chunk_points = 0;
+  for (pcd_chunk const &c : rebuilt.chunks) chunk_points += c.num_points;
+  report(ok && chunk_points == points.size(), "region/stale_index",
+         std::string(stale ? "stale" : "not stale") + " after a rewrite, rebuilt over "
+         + std::to_string(chunk_points) + " points");
+
+  // Where the index cannot be written (here a directory is in the way)
+  std::string uncached = (dir / "uncached.pcd").string();
+  write_test_pcd(uncached, points);
+  fs::create_directories(partial_filename(pcd_index_filename(uncached)));
+  pcd_index unsaved;
+  log.str("");
+  ok = get_pcd_index(uncached, unsaved, log) && !fs::exists(pcd_index_filename(uncached))
+       && unsaved.chunks.size() == expected.chunks.size() && log.str().find("Couldn't cache") == 0;
+  report(ok, "region/uncached_index", ok ? "used, and reported as not cached" : log.str());
+}
+
+/****************************************/
+/*              Pipe Mode               */
+/****************************************/
+
+/* A PCD of points in memory, ascii (%.9g, integer intensities) or binary */
+std::string pcd_text(const cloud &points, bool binary) {
+  std::ostringstream oss;
+  oss << "VERSION .7\nFIELDS x y z intensity\nSIZE 4 4 4 4\nTYPE F F F F\nCOUNT 1 1 1 1\n"
+      << "WIDTH " << points.size() << "\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\n"
+      << "POINTS " << points.size() << "\nDATA " << (binary ? "binary" : "ascii") << "\n";
+  if (binary) {
+    oss.write((const char *) points.data(), points.size() * sizeof(test_point));
+  } else {
+    oss << std::setprecision(9);
+    for (test_point const &p : points) oss << p.x << " " << p.y << " " << p.z << " " << (int) p.intensity << "\n";
+  }
+  return oss.str();
+}
+
+bool read_pcd_text(const std::string &text, cloud &points) {
+  std::istringstream is(text);
+  pcd_header h;
+  pcd_point_decoder<test_point> decoder;
+  if (!read_pcd_header(is, h) || !decoder.init(h)) return false;
+  points.resize(h.points);
+  std::vector<char> record(h.point_size);
+  std::string line;
+  for (test_point &p : points) {
+    if (h.data == "binary") {
+      if (!is.read(record.data(), h.point_size)) return false;
+      decoder.decode_binary(h, record.data(), p);
+    } else if (!std::getline(is, line) || !decoder.decode_ascii(line, p)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Stream text through pcd_record_buffer batches against a ground raster
+ * file as flatten_pipe does, labelling ground by batch. Returns the output. */
+template <typename Options>
+std::string stream_pipe(const std::string &text, std::string ground_filename, std::vector<uint8_t> &labels) {
+  std::istringstream is(text);
+  std::ostringstream os;
+  pcd_header h;
+  pcd_record_buffer records;
+  grid pcl_grid(GRID_SIDE_LEN);
+  std::vector<float> floor_zs, raster;
+  if (!read_pcd_header(is, h) || !records.init(h) || !read_ground_raster(ground_filename, pcl_grid, floor_zs)) {
+    return "";
+  }
+  if (!Options::adjust_slope) pad_floor_raster(floor_zs, pcl_grid.h(), pcl_grid.w(), raster);
+  labels.assign(ground_label_bytes(h.points), 0);
+  write_pcd_header(os, h);
+  std::vector<lidar_point> batch;
+  size_t num_written = 0;
+  while (records.read(is, PIPE_BATCH_POINTS) > 0) {
+    batch.resize(records.size());
+    for (size_t k = 0; k < records.size(); k++) batch[k] = records.point(k);
+    flatten_batch<Options>(batch, pcl_grid, floor_zs, raster, &labels[num_written / 8], GROUND_LABEL_HEIGHT);
+    for (size_t k = 0; k < records.size(); k++) records.set_point(k, batch[k]);
+    records.write(os);
+    num_written += records.size();
+    records.clear();
+  }
+  return os.str();
+}
+
+/* The whole cloud flattened with its ground saved, then the same cloud
+ * streamed in batches against that ground, in both formats and both adjust
+ * passes. Binary outputs must match bit for bit; ascii ones within the
+ * %.8g the records are rewritten with. Intensities pass through. */
+template <typename Options>
+void check_pipe(fs::path dir, std::string pass) {
+  cloud points;
+  generate_scan(points, 20000);
+  for (test_point &p : points) p.z += 0.5f; // some points above, some below the label height
+  std::string ground_filename = (dir / ("pipe_" + pass + ".ground")).string();
+  for (int binary = 1; binary >= 0; binary--) {
+    std::string text = pcd_text(points, binary);
+    cloud input, full;
+    read_pcd_text(text, input);
+    full = input;
+    grid pcl_grid(GRID_SIDE_LEN);
+    pcl_grid.compute_grid(compute_full_bbox(full));
+    std::vector<float> floor_zs;
+    flatten_over<Options>(full, pcl_grid, &floor_zs);
+    write_ground_raster(ground_filename, pcl_grid, floor_zs);
+
+    std::vector<uint8_t> labels;
+    cloud streamed;
+    bool read = read_pcd_text(stream_pipe<Options>(text, ground_filename, labels), streamed)
+                && streamed.size() == full.size();
+    const float TOLERANCE = binary ? 0 : 1e-4;
+    size_t mismatches = 0, label_mismatches = 0;
+    for (size_t k = 0; read && k < full.size(); k++) {
+      if (std::fabs(streamed[k].x - full[k].x) > TOLERANCE || std::fabs(streamed[k].y - full[k].y) > TOLERANCE
+          || std::fabs(streamed[k].z - full[k].z) > TOLERANCE || streamed[k].intensity != input[k].intensity) {
+        mismatches++;
+      }
+      if (ground_label(labels.data(), k) != (full[k].z < GROUND_LABEL_HEIGHT)) label_mismatches++;
+    }
+    std::ostringstream detail;
+    detail << full.size() << " points in batches of " << PIPE_BATCH_POINTS << ", " << mismatches
+           << " differ, " << label_mismatches << " labels differ";
+    report(read && mismatches == 0 && label_mismatches == 0,
+           "pipe/" + pass + (binary ? "/binary" : "/ascii"), detail.str());
+  }
+}
+
+/****************************************/
+/*            World Ground              */
+/****************************************/
+
+/* Floor per world cell over points, as compute_floor_zs takes it */
+std::map<std::pair<int64_t, int64_t>, float> world_floors(const cloud &points) {
+  std::map<std::pair<int64_t, int64_t>, std::vector<float> > cell_zs;
+  for (test_point const &p : points) {
+    cell_zs[std::make_pair((int64_t) std::floor(p.x / GRID_SIDE_LEN), (int64_t) std::floor(p.y / GRID_SIDE_LEN))]
+        .push_back(p.z);
+  }
+  std::map<std::pair<int64_t, int64_t>, float> floors;
+  for (auto &cell : cell_zs) {
+    std::vector<float> &zs = cell.second;
+    if (zs.size() <= (size_t) MIN_POINTS_PER_BLOCK) continue;
+    std::nth_element(zs.begin(), zs.begin() + zs.size() / 20, zs.end());
+    floors[cell.first] = zs[zs.size() / 20];
+  }
+  return floors;
+}
+
+/* Lay a grid over frame, add it and read its floors; returns the largest
+ * distance from the floors of seen over the same cells (-1 if a cell with
+ * a floor in seen has none) */
+float add_frame(world_ground &world, const cloud &frame, const cloud &seen, std::vector<float> &floor_zs,
+                bool *aligned) {
+  grid pcl_grid(GRID_SIDE_LEN);
+  world.align_grid(compute_points_bbox(frame), pcl_grid);
+  *aligned = std::fmod(pcl_grid.origin_x(), GRID_SIDE_LEN) == 0 && std::fmod(pcl_grid.origin_y(), GRID_SIDE_LEN) == 0;
+  world.add_points(frame, pcl_grid);
+  world.floor_zs(pcl_grid, floor_zs);
+  std::map<std::pair<int64_t, int64_t>, float> expected = world_floors(seen);
+  int64_t i0 = (int64_t) std::floor(pcl_grid.origin_x() / GRID_SIDE_LEN + 0.5f);
+  int64_t j0 = (int64_t) std::floor(pcl_grid.origin_y() / GRID_SIDE_LEN + 0.5f);
+  float max_abs = 0;
+  for (int y = 0; y < pcl_grid.h(); y++) {
+    for (int x = 0; x < pcl_grid.w(); x++) {
+      auto it = expected.find(std::make_pair(i0 + x, j0 + y));
+      if (it == expected.end()) continue;
+      float z = floor_zs[y * pcl_grid.w() + x];
+      if (z == 0) return -1;
+      max_abs = std::max(max_abs, std::fabs(z - it->second));
+    }
+  }
+  return max_abs;
+}
+
+/* Two overlapping frames of one route: each frame's floors are those of
+ * every point seen so far in its cells, within half a histogram bin. Then
+ * one frame again and again, until its cells saturate: their floors must
+ * then stay put, even under points far below them. */
+void check_world_ground() {
+  cloud route;
+  generate_scan(route, 12000);
+  cloud first(route.begin(), route.begin() + 7000), second(route.begin() + 5000, route.end());
+  cloud seen = first;
+  world_ground world(GRID_SIDE_LEN, MIN_POINTS_PER_BLOCK);
+  std::vector<float> floor_zs;
+  const float TOLERANCE = WORLD_GROUND_BIN_LEN / 2 + 1e-5;
+  bool aligned_first, aligned_second;
+  float first_abs = add_frame(world, first, seen, floor_zs, &aligned_first);
+  seen.insert(seen.end(), second.begin(), second.end());
+  float second_abs = add_frame(world, second, seen, floor_zs, &aligned_second);
+  std::ostringstream detail;
+  detail << "max |d| " << first_abs << " then " << second_abs << " over " << world.num_cells() << " cells";
+  report(first_abs >= 0 && first_abs <= TOLERANCE && second_abs >= 0 && second_abs <= TOLERANCE
+         && aligned_first && aligned_second, "world_ground/overlap", detail.str());
+
+  world_ground repeated(GRID_SIDE_LEN, MIN_POINTS_PER_BLOCK);
+  std::vector<float> saturated_zs;
+  bool aligned;
+  for (int i = 0; i < 8; i++) add_frame(repeated, first, first, saturated_zs, &aligned);
+  size_t num_saturated = repeated.num_floors_saturated();
+  cloud lowered = first;
+  for (test_point &p : lowered) p.z -= 10;
+  add_frame(repeated, lowered, first, floor_zs, &aligned);
+  size_t num_floors = 0, num_kept = 0;
+  for (size_t c = 0; c < floor_zs.size(); c++) {
+    num_floors += (floor_zs[c] != 0);
+    num_kept += (floor_zs[c] != 0 && floor_zs[c] == saturated_zs[c]);
+  }
+  // every floor but the saturated ones is re-read; only re-read floors can move
+  detail.str("");
+  detail << num_saturated << " of " << num_floors << " floors saturated, " << repeated.num_floors_updated()
+         << " re-read, " << num_kept << " kept under points 10 m lower";
+  report(num_saturated > 0 && repeated.num_floors_saturated() == num_saturated
+         && repeated.num_floors_updated() == num_floors - num_saturated && num_kept >= num_saturated
+         && num_kept < num_floors, "world_ground/saturation", detail.str());
+}
+
+/****************************************/
+/*             Run Journal              */
+/****************************************/
+
+bool write_file(fs::path path, std::string contents) {
+  fs::create_directories(path.parent_path());
+  std::ofstream ofs(path.string(), std::ios_base::out | std::ios_base::binary);
+  ofs << contents;
+  return (bool) ofs;
+}
+
+input_file input(fs::path path) {
+  return input_file{path.string(), fs::file_size(path)};
+}
+
+/* A journal from a run cut off mid-line, resumed: which inputs are skipped */
+void check_journal(fs::path dir) {
+  std::string filename = (dir / "journal").string();
+  fs::path a = dir / "in/a.pcd", b = dir / "in/b.pcd", c = dir / "in/c.pcd", a_out = dir / "out/a_flat.pcd";
+  write_file(a, "a");
+  write_file(b, "bb");
+  write_file(c, "ccc");
+  const std::string SETTINGS = ".pcd";
+  bool ok = true;
+  {
+    run_journal journal;
+    ok = journal.open(filename, true) && journal.record(run_journal::entry(input(a), SETTINGS))
+         && journal.record(run_journal::entry(input(b), SETTINGS, "quarantined"));
+  }
+  std::string cut_entry = run_journal::entry(input(c), SETTINGS);
+  std::ofstream(filename, std::ios_base::app) << cut_entry.substr(0, cut_entry.size() / 2);
+
+  std::vector<std::string> why; // checks that failed
+  std::vector<std::string> outputs = {a_out.string()};
+  {
+    run_journal journal;
+    ok = ok && journal.open(filename, true);
+    if (journal.finished(input(a), SETTINGS, outputs)) why.push_back("done without its output");
+    write_file(a_out, "flat");
+    if (!journal.finished(input(a), SETTINGS, outputs)) why.push_back("not done with its output");
+    if (journal.finished(input(a), SETTINGS + ":0,0,1,1", outputs)) why.push_back("done under other settings");
+    if (!journal.quarantined(input(b), SETTINGS) || journal.finished(input(b), SETTINGS, {})) {
+      why.push_back("quarantine lost");
+    }
+    if (journal.finished(input(c), SETTINGS, {})) why.push_back("cut off entry read");
+    ok = ok && journal.record(cut_entry);
+  }
+  write_file(a, "changed");
+  {
+    run_journal journal;
+    ok = ok && journal.open(filename, true);
+    if (!journal.finished(input(c), SETTINGS, {})) why.push_back("entry after a cut off line lost");
+    if (journal.finished(input(a), SETTINGS, outputs)) why.push_back("changed input done");
+  }
+  {
+    run_journal journal;
+    ok = ok && journal.open(filename, false); // --fresh
+  }
+  {
+    run_journal journal;
+    ok = ok && journal.open(filename, true);
+    if (journal.finished(input(c), SETTINGS, {}) || journal.quarantined(input(b), SETTINGS)) {
+      why.push_back("entries kept by a fresh run");
+    }
+  }
+  std::string detail = ok ? "" : "I/O error; ";
+  for (std::string const &w : why) detail += w + "; ";
+  report(ok && why.empty(), "journal", why.empty() && ok ? "resume skips only unchanged finished inputs" : detail);
+}
+
+/****************************************/
+/*           Input Discovery            */
+/****************************************/
+
+void check_input_files(fs::path dir) {
+  fs::path root = dir / "inputs";
+  write_file(root / "tile_1.pcd", "1");
+  write_file(root / "a/tile_2.pcd", "22");
+  write_file(root / "a/tile_3_old.pcd", "333");
+  write_file(root / "b/tile_1.pcd", "4444");
+  write_file(root / "b/notes.txt", "55555");
+  write_file(root / "b/scan.pcd", "666666");
+  write_file(root / "flat_output/tile_1_flat.pcd", "7777777");
+  std::vector<std::string> none, tiles = {"tile_[12]*"}, old = {"*_old.pcd"};
+
+  std::vector<input_file> all, matched;
+  find_input_files(root, ".pcd", none, none, root / "flat_output", all);
+  find_input_files(root, ".pcd", tiles, old, root / "flat_output", matched);
+  sort_largest_first(all);
+  std::vector<std::string> names;
+  for (input_file const &f : all) names.push_back(fs::path(f.path).lexically_relative(root).string());
+  std::vector<std::pair<std::string, std::string> > collisions;
+  find_output_collisions(matched, ".pcd", collisions);
+
+  const std::vector<std::string> EXPECTED = {"b/scan.pcd", "b/tile_1.pcd", "a/tile_3_old.pcd", "a/tile_2.pcd",
+                                             "tile_1.pcd"};
+  std::ostringstream detail;
+  detail << all.size() << " inputs, " << matched.size() << " matching the globs, " << collisions.size()
+         << " output collision(s)";
+  report(names == EXPECTED && matched.size() == 3 && collisions.size() == 1
+         && basename(collisions[0].first) == "tile_1.pcd" && basename(collisions[0].second) == "tile_1.pcd"
+         && collisions[0].first != collisions[0].second
+         && output_basename("dir/a.pcd", ".fcol") == "a_flat.fcol", "input_files", detail.str());
+}
+
+int main() {
+  fs::path dir = fs::temp_directory_path() / fs::unique_path("flatten-components-%%%%%%%%");
+  fs::create_directories(dir);
+  check_region(dir);
+  check_pipe<full_options>(dir, "slope");
+  check_pipe<height_options>(dir, "heights");
+  check_world_ground();
+  check_journal(dir);
+  check_input_files(dir);
+  fs::remove_all(dir);
+  if (failures > 0) std::cout << failures << " check(s) failed" << std::endl;
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,575 @@
+
+/****************************************/
+/*     Flattening Regression Harness    */
+/****************************************/
+
+// Runs new_flatten_pcl's pipeline (pipeline.hpp) in each configuration, and
+// the legacy stages as a reference, on a small corpus and checks that
+//  - the reference (legacy) and the scan- and Morton-ordered float paths
+//    print exactly as the original flatten_pcl.cpp does on the same input
+//    (tests/golden/<case>.baseline.pcd, from _misc/baseline_golden.sh),
+//  - every other output matches its golden file in tests/golden within
+//    per-field tolerances (and the worst deviation seen is reported),
+//  - each threaded path's output is bit-identical for every thread count,
+//  - the scan- and Morton-ordered float paths are bit-identical to legacy,
+//    and the height-only kernel to the scalar height-only adjust pass,
+//  - each path's ground labels, in its output's point order, match its
+//    output heights and read back the same from a labels file,
+//  - a columnar (.fcol) output reads back whole and by region,
+//  - packed rgb fields are read with their bits unchanged.
+// Bit-identity across SIMD levels is checked by building this twice (see
+// CMakeLists.txt) and comparing the --digest output of both builds.
+//
+// Usage: ./regression_test <tests_dir> [--update-golden | --digest | --write-inputs DIR]
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "aux_types.h"
+#include "grid.hpp"
+#include "util.h"
+#include "flatten.hpp"
+#include "ground_labels.hpp"
+#include "columnar.hpp"
+#include "point_traits.hpp"
+#include "pcd_io.hpp"
+#include "pipeline.hpp"
+#include "region.hpp" // bbox_contains
+#include "scratch_arena.hpp"
+#include "test_corpus.hpp"
+
+const float GRID_SIDE_LEN = 20;
+const int MIN_POINTS_PER_BLOCK = 100;
+const int THREAD_COUNTS[] = {1, 2, 3, 8};
+const float GROUND_LABEL_HEIGHT = 0.2;
+const double COLUMNAR_PRECISION = 0.001;
+
+// A packed float "rgb" field, read as new_flatten_pcl reads pcl::PointXYZRGB
+struct rgb_point {
+  float x, y, z;
+  float rgb;
+};
+
+template <>
+struct point_traits<rgb_point> {
+  static const int num_fields = 1;
+  static const char *field(int /* i */) { return "rgb"; }
+  static bool packed(int /* i */) { return true; }
+  static void set_field(rgb_point & /* p */, int /* i */, double /* v */) {}
+  static void set_packed_field(rgb_point &p, int /* i */, uint32_t bits) { memcpy(&p.rgb, &bits, sizeof(bits)); }
+  static float intensity(const rgb_point & /* p */) { return 0; }
+};
+
+/****************************************/
+/*               Corpus                 */
+/****************************************/
+
+/* Terraces one cell wide, with sparse cells below MIN_POINTS_PER_BLOCK */
+void generate_steps(cloud &points) {
+  test_rng rng(7);
+  for (int i = 0; i < 3000; i++) {
+    float x = 100 * rng.unit();
+    float y = 60 * rng.unit();
+    if (x > 80 && rng.unit() < 0.9f) continue; // thin out the last column of cells
+    float z = 1.5f * (int) (x / GRID_SIDE_LEN) + rng.noise(0.02f);
+    points.push_back(test_point{x, y, z, (float) (i % 256)});
+  }
+}
+
+/* Write a case as the original flatten_pcl.cpp reads it: ascii, integer
+ * intensities, floats with enough digits to read back exactly */
+bool write_baseline_input(std::string filename, const cloud &points) {
+  std::ofstream ofs(filename);
+  ofs << "VERSION .7\nFIELDS x y z intensity\nSIZE 4 4 4 4\nTYPE F F F F\nCOUNT 1 1 1 1\n"
+      << "WIDTH " << points.size() << "\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\n"
+      << "POINTS " << points.size() << "\nDATA ascii\n" << std::setprecision(9);
+  for (test_point const &p : points) ofs << p.x << " " << p.y << " " << p.z << " " << (int) p.intensity << "\n";
+  return (bool) ofs;
+}
+
+/* A point as flatten_pcl.cpp prints it (default stream precision) */
+std::string baseline_line(const test_point &p) {
+  std::ostringstream oss;
+  oss << p.x << " " << p.y << " " << p.z << " " << (int) p.intensity;
+  return oss.str();
+}
+
+/* The point lines of a flatten_pcl.cpp output */
+bool read_baseline_lines(std::string filename, std::vector<std::string> &lines) {
+  std::ifstream ifs(filename);
+  std::string line;
+  bool in_data = false;
+  while (std::getline(ifs, line)) {
+    if (in_data) lines.push_back(line);
+    if (line.compare(0, 4, "DATA") == 0) in_data = true;
+  }
+  return in_data;
+}
+
+/****************************************/
+/*          Flattening Paths            */
+/****************************************/
+
+typedef flatten_options<true, false> full_options;
+typedef flatten_options<false, false> height_options;
+
+/* Pipeline settings of each configuration, as new_flatten_pcl's constants
+ * would set them (min points, spatial sort, restore order, plane model,
+ * compact points and their precision, Morton output, label height) */
+const pipeline_settings SCAN_ORDER = {MIN_POINTS_PER_BLOCK, false, true, false, false, 0.001, false,
+                                      GROUND_LABEL_HEIGHT};
+const pipeline_settings MORTON_ORDER = {MIN_POINTS_PER_BLOCK, true, true, false, false, 0.001, false,
+                                        GROUND_LABEL_HEIGHT};
+const pipeline_settings MORTON_KEPT = {MIN_POINTS_PER_BLOCK, true, false, false, false, 0.001, false,
+                                       GROUND_LABEL_HEIGHT};
+const pipeline_settings PLANE_MODEL = {MIN_POINTS_PER_BLOCK, false, true, true, false, 0.001, false,
+                                       GROUND_LABEL_HEIGHT};
+const pipeline_settings COMPACT = {MIN_POINTS_PER_BLOCK, true, true, false, true, 0.001, false,
+                                   GROUND_LABEL_HEIGHT};
+const pipeline_settings COLUMNAR = {MIN_POINTS_PER_BLOCK, false, true, false, false, 0.001, true,
+                                    GROUND_LABEL_HEIGHT};
+
+/* Run new_flatten_pcl's pipeline (pipeline.hpp) on points over their own grid.
+ * Returns true if it leaves them in Morton order (scratch.order). */
+template <typename Options>
+bool run_pipeline(cloud &points, const pipeline_settings &settings, int num_threads, bool label_ground,
+                  flatten_scratch<test_point> &scratch) {
+  grid pcl_grid(GRID_SIDE_LEN);
+  pcl_grid.compute_grid(compute_full_bbox(points));
+  return flatten_cloud<Options>(points, pcl_grid, NULL, label_ground, scratch, settings, num_threads, std::cout);
+}
+
+/* flatten_pcl.cpp: bin, floor and adjust in input order. Kept as the
+ * reference the pipeline's float paths must match bit for bit. */
+void flatten_legacy(cloud &points, int /* num_threads */) {
+  grid pcl_grid(GRID_SIDE_LEN);
+  pcl_grid.compute_grid(compute_full_bbox(points));
+  std::vector<uint32_t> cell_ids, cell_starts;
+  std::vector<float> cell_zs, floor_zs;
+  compute_cell_ids(points, pcl_grid, cell_ids);
+  bin_zs(points, cell_ids, pcl_grid.h() * pcl_grid.w(), cell_starts, cell_zs);
+  compute_floor_zs(cell_starts, cell_zs, MIN_POINTS_PER_BLOCK, floor_zs);
+  adjust_points<full_options>(points, pcl_grid, floor_zs);
+}
+
+/* The legacy stages with the scalar height-only adjust pass. Kept as the
+ * reference the height kernel must match bit for bit. */
+void flatten_height_scalar(cloud &points) {
+  grid pcl_grid(GRID_SIDE_LEN);
+  pcl_grid.compute_grid(compute_full_bbox(points));
+  std::vector<uint32_t> cell_ids, cell_starts;
+  std::vector<float> cell_zs, floor_zs;
+  compute_cell_ids(points, pcl_grid, cell_ids);
+  bin_zs(points, cell_ids, pcl_grid.h() * pcl_grid.w(), cell_starts, cell_zs);
+  compute_floor_zs(cell_starts, cell_zs, MIN_POINTS_PER_BLOCK, floor_zs);
+  adjust_points<height_options>(points, pcl_grid, floor_zs);
+}
+
+/* new_flatten_pcl default: the pipeline in scan order */
+void flatten_scan(cloud &points, int num_threads) {
+  flatten_scratch<test_point> scratch;
+  run_pipeline<full_options>(points, SCAN_ORDER, num_threads, false, scratch);
+}
+
+/* SPATIAL_SORT: on a copy sorted on num_threads threads, written back in input order */
+void flatten_morton(cloud &points, int num_threads) {
+  flatten_scratch<test_point> scratch;
+  run_pipeline<full_options>(points, MORTON_ORDER, num_threads, false, scratch);
+}
+
+/* ADJUST_SLOPE = false: the vectorized height-only kernel, in place */
+void flatten_height_only(cloud &points, int num_threads) {
+  flatten_scratch<test_point> scratch;
+  run_pipeline<height_options>(points, SCAN_ORDER, num_threads, false, scratch);
+}
+
+/* PLANE_GROUND_MODEL: robust plane per cell, fitted on num_threads threads */
+void flatten_plane(cloud &points, int num_threads) {
+  flatten_scratch<test_point> scratch;
+  run_pipeline<full_options>(points, PLANE_MODEL, num_threads, false, scratch);
+}
+
+/* COMPACT_POINTS: binned as fixed-point copies in Morton order, adjusted in place */
+void flatten_compact(cloud &points, int num_threads) {
+  flatten_scratch<test_point> scratch;
+  run_pipeline<full_options>(points, COMPACT, num_threads, false, scratch);
+}
+
+/* A pipeline configuration whose ground labels are checked */
+struct label_path {
+  const char *name;
+  bool (*run)(cloud &points, const pipeline_settings &settings, int num_threads, bool label_ground,
+              flatten_scratch<test_point> &scratch);
+  const pipeline_settings *settings;
+};
+
+const label_path LABEL_PATHS[] = {
+  {"default",     run_pipeline<full_options>,   &SCAN_ORDER},   // float write-back
+  {"morton",      run_pipeline<full_options>,   &MORTON_ORDER}, // written back to input order
+  {"morton_kept", run_pipeline<full_options>,   &MORTON_KEPT},  // left in Morton order
+  {"heights",     run_pipeline<height_options>, &SCAN_ORDER},   // the height kernel
+  {"plane",       run_pipeline<full_options>,   &PLANE_MODEL},
+  {"compact",     run_pipeline<full_options>,   &COMPACT},      // adjusted in place
+  {"columnar",    run_pipeline<full_options>,   &COLUMNAR},     // reordered to the output's Morton order
+};
+
+/* Ground labels of each path, in the order its output is written (as
+ * flatten_pcd writes them): set exactly for the output points below the
+ * label height, and unchanged by a round trip through a labels file.
+ * Returns the number of failed checks. */
+int check_ground_labels(std::string case_name, const cloud &input) {
+  int failures = 0;
+  for (label_path const &path : LABEL_PATHS) {
+    std::string label = case_name + "/" + path.name + "/labels";
+    cloud points = input;
+    flatten_scratch<test_point> scratch;
+    bool in_morton_order = path.run(points, *path.settings, 2, true, scratch);
+    const std::vector<uint8_t> *labels = &scratch.labels;
+    const std::vector<uint32_t> *order = NULL; // output point k is points[(*order)[k]]
+    if (path.settings->morton_output && !in_morton_order) {
+      order = &scratch.order;
+      scratch.output_labels.resize(ground_label_bytes(points.size()));
+      reorder_ground_labels(scratch.labels.data(), *order, points.size(), scratch.output_labels.data());
+      labels = &scratch.output_labels;
+    }
+
+    int path_failures = 0;
+    size_t mismatches = 0, num_ground = 0;
+    for (size_t k = 0; k < points.size(); k++) {
+      bool ground = ground_label(labels->data(), k);
+      num_ground += ground;
+      if (ground != (points[order ? (*order)[k] : k].z < GROUND_LABEL_HEIGHT)) mismatches++;
+    }
+    if (mismatches > 0) {
+      std::cout << "FAIL: " << label << " has " << mismatches << " labels not matching z" << std::endl;
+      path_failures++;
+    }
+
+    boost::filesystem::path filename =
+        boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("flatten-labels-%%%%%%%%");
+    std::vector<uint8_t> read_back;
+    size_t num_read = 0;
+    float height_read = 0;
+    bool round_trip = write_ground_labels(filename.string(), labels->data(), points.size(), GROUND_LABEL_HEIGHT)
+                      && read_ground_labels(filename.string(), read_back, &num_read, &height_read)
+                      && num_read == points.size() && height_read == GROUND_LABEL_HEIGHT && read_back == *labels;
+    boost::filesystem::remove(filename);
+    if (!round_trip) {
+      std::cout << "FAIL: " << label << " differ after a round trip through a labels file" << std::endl;
+      path_failures++;
+    }
+    if (path_failures == 0) {
+      std::cout << "ok    " << std::left << std::setw(30) << label << std::right << " "
+                << num_ground << " of " << points.size() << " points ground" << std::endl;
+    }
+    failures += path_failures;
+  }
+  return failures;
+}
+
+/* Packed rgb fields: their 32 bits read back unchanged from a binary record
+ * (also a signalling NaN pattern, which a float conversion would quieten)
+ * and from ascii, where PCL writes them as an unsigned integer. Returns the
+ * number of failed checks. */
+int check_packed_fields() {
+  const uint32_t COLOURS[] = {0x00ff8000, 0xff9a3c10, 0xffffffff, 0x7f800001};
+  std::istringstream header("VERSION .7\nFIELDS x y z rgb\nSIZE 4 4 4 4\nTYPE F F F F\nCOUNT 1 1 1 1\n"
+                            "WIDTH 1\nHEIGHT 1\nPOINTS 1\nDATA binary\n");
+  pcd_header h;
+  pcd_point_decoder<rgb_point> decoder;
+  if (!read_pcd_header(header, h) || !decoder.init(h)) {
+    std::cout << "FAIL: packed fields: couldn't read the header" << std::endl;
+    return 1;
+  }
+  int failures = 0;
+  for (uint32_t colour : COLOURS) {
+    float record[4] = {1, 2, 3, 0};
+    memcpy(&record[3], &colour, 4);
+    rgb_point binary_point, ascii_point;
+    decoder.decode_binary(h, (const char *) record, binary_point);
+    bool parsed = decoder.decode_ascii("1 2 3 " + std::to_string(colour), ascii_point);
+    uint32_t binary_bits, ascii_bits;
+    memcpy(&binary_bits, &binary_point.rgb, 4);
+    memcpy(&ascii_bits, &ascii_point.rgb, 4);
+    if (binary_bits != colour || !parsed || ascii_bits != colour) {
+      std::cout << "FAIL: packed field " << std::hex << colour << " read as " << binary_bits << " (binary), "
+                << ascii_bits << " (ascii)" << std::dec << std::endl;
+      failures++;
+    }
+  }
+  if (failures == 0) {
+    std::cout << "ok    " << std::left << std::setw(30) << "packed rgb" << std::right << " "
+              << sizeof(COLOURS) / sizeof(COLOURS[0]) << " colours, binary and ascii" << std::endl;
+  }
+  return failures;
+}
+
+/* Columnar output: a cloud of several chunks flattened for COLUMNAR_OUTPUT,
+ * written in Morton order and read back whole (every point within half the
+ * precision, in output order) and by region (one grid cell: fewer chunks,
+ * the same points in the cell). Returns the number of failed checks. */
+int check_columnar() {
+  cloud points;
+  generate_scan(points, 4 * COLUMNAR_CHUNK_POINTS);
+  flatten_scratch<test_point> scratch;
+  run_pipeline<full_options>(points, COLUMNAR, 2, false, scratch);
+  const std::vector<uint32_t> &order = scratch.order;
+
+  boost::filesystem::path filename =
+      boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("flatten-columnar-%%%%%%%%.fcol");
+  columnar_reader reader;
+  std::vector<lidar_point> all, region;
+  bbox box = compute_full_bbox(points);
+  bbox corner = {box.minx, box.miny, box.minx + GRID_SIDE_LEN, box.miny + GRID_SIDE_LEN}; // one grid cell
+  int chunks_read = -1;
+  bool read = write_columnar(filename.string(), points, &order, COLUMNAR_PRECISION) && reader.open(filename.string())
+              && reader.precision() == COLUMNAR_PRECISION && reader.read_region(box, all) >= 0;
+  if (read) chunks_read = reader.read_region(corner, region);
+  size_t num_chunks = reader.chunks().size();
+  boost::filesystem::remove(filename);
+  if (!read || chunks_read < 0 || all.size() != points.size()) {
+    std::cout << "FAIL: columnar round trip couldn't write or read back " << points.size() << " points" << std::endl;
+    return 1;
+  }
+
+  int failures = 0;
+  size_t mismatches = 0;
+  const float TOLERANCE = COLUMNAR_PRECISION / 2 + 1e-4; // rounding, plus float error at these coordinates
+  for (size_t k = 0; k < all.size(); k++) {
+    test_point const &p = points[order[k]];
+    if (std::fabs(all[k].x - p.x) > TOLERANCE || std::fabs(all[k].y - p.y) > TOLERANCE
+        || std::fabs(all[k].z - p.z) > TOLERANCE || all[k].intensity != (int) std::llround(p.intensity)) {
+      mismatches++;
+    }
+  }
+  if (mismatches > 0) {
+    std::cout << "FAIL: columnar round trip has " << mismatches << " points not matching the output" << std::endl;
+    failures++;
+  }
+  auto num_inside = [&corner](const std::vector<lidar_point> &read_points) {
+    return std::count_if(read_points.begin(), read_points.end(),
+                         [&corner](const lidar_point &p) { return bbox_contains(corner, p.x, p.y); });
+  };
+  if (chunks_read >= (int) num_chunks || num_inside(region) != num_inside(all)) {
+    std::cout << "FAIL: columnar region read " << chunks_read << " of " << num_chunks << " chunks, "
+              << num_inside(region) << " of " << num_inside(all) << " points in the region" << std::endl;
+    failures++;
+  }
+  if (failures == 0) {
+    std::cout << "ok    " << std::left << std::setw(30) << "columnar" << std::right << " "
+              << points.size() << " points round trip, region read " << chunks_read << " of " << num_chunks
+              << " chunks" << std::endl;
+  }
+  return failures;
+}
+
+/* A path and its golden tolerances per field, in metres (intensity in units).
+ * Only paths with threaded stages are run for every thread count. Paths
+ * checked against the baseline must print exactly as it does instead. */
+struct flatten_path {
+  const char *name;
+  void (*flatten)(cloud &points, int num_threads);
+  bool threaded;
+  bool baseline;       // checked against flatten_pcl.cpp's output, not a golden of its own
+  float tolerances[4]; // x, y, z, intensity
+};
+
+const flatten_path PATHS[] = {
+  {"legacy",  flatten_legacy,      false, true,  {0,    0,    0,    0}},
+  {"default", flatten_scan,        false, true,  {0,    0,    0,    0}},
+  {"morton",  flatten_morton,      true,  true,  {0,    0,    0,    0}}, // Morton sort
+  {"heights", flatten_height_only, false, false, {0,    0,    0,    0}},
+  {"plane",   flatten_plane,       true,  false, {1e-3, 1e-3, 1e-3, 0}}, // plane fits; iterative
+  {"compact", flatten_compact,     true,  false, {2e-3, 2e-3, 2e-3, 0}}, // floors rounded to 1 mm
+};
+
+/****************************************/
+/*               Checks                 */
+/****************************************/
+
+const char *FIELD_NAMES[] = {"x", "y", "z", "intensity"};
+
+float field(const test_point &p, int f) {
+  return (f == 0) ? p.x : (f == 1) ? p.y : (f == 2) ? p.z : p.intensity;
+}
+
+/* FNV-1a of the output bytes */
+uint64_t digest(const cloud &points) {
+  uint64_t hash = 14695981039346656037ULL;
+  const unsigned char *bytes = (const unsigned char *) points.data();
+  for (size_t i = 0; i < points.size() * sizeof(test_point); i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool bit_identical(const cloud &a, const cloud &b) {
+  return a.size() == b.size() && std::equal((const char *) a.data(), (const char *) (a.data() + a.size()),
+                                            (const char *) b.data());
+}
+
+struct deviation {
+  float max_abs[4];
+  std::string where[4]; // case/path of each field's worst deviation
+};
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " <tests_dir> [--update-golden | --digest | --write-inputs DIR]"
+              << std::endl;
+    return 2;
+  }
+  std::string tests_dir(argv[1]);
+  std::string mode = (argc > 2) ? argv[2] : "";
+  bool update = (mode == "--update-golden");
+  bool print_digests = (mode == "--digest");
+
+  // Corpus: generated clouds and the checked-in ones in tests/data
+  std::vector<std::string> case_names;
+  std::vector<cloud> inputs;
+  case_names.push_back("scan");
+  inputs.push_back(cloud());
+  generate_scan(inputs.back());
+  case_names.push_back("steps");
+  inputs.push_back(cloud());
+  generate_steps(inputs.back());
+  const char *CHECKED_IN[] = {"ramp_ascii", "hill_binary"};
+  for (const char *name : CHECKED_IN) {
+    case_names.push_back(name);
+    inputs.push_back(cloud());
+    if (!read_test_pcd(path_join(tests_dir, std::string("data/") + name + ".pcd"), inputs.back())) {
+      std::cout << "FAIL: couldn't read tests/data/" << name << ".pcd" << std::endl;
+      return 1;
+    }
+  }
+
+  // Inputs for flatten_pcl.cpp, to regenerate the baseline outputs from
+  if (mode == "--write-inputs") {
+    for (size_t c = 0; argc > 3 && c < inputs.size(); c++) {
+      if (!write_baseline_input(path_join(argv[3], case_names[c] + ".pcd"), inputs[c])) return 1;
+    }
+    return argc > 3 ? 0 : 2;
+  }
+
+  int failures = 0;
+  deviation worst = {{0, 0, 0, 0}, {"", "", "", ""}};
+  for (size_t c = 0; c < inputs.size(); c++) {
+    cloud legacy_output;
+    for (flatten_path const &path : PATHS) {
+      std::string label = case_names[c] + "/" + path.name;
+
+      // Same result for every thread count
+      cloud output;
+      for (int num_threads : THREAD_COUNTS) {
+        if (!path.threaded && num_threads != THREAD_COUNTS[0]) break;
+        cloud points = inputs[c];
+        path.flatten(points, num_threads);
+        if (num_threads == THREAD_COUNTS[0]) {
+          output = points;
+        } else if (!bit_identical(points, output)) {
+          std::cout << "FAIL: " << label << " differs with " << num_threads << " threads" << std::endl;
+          failures++;
+        }
+      }
+      if (print_digests) {
+        std::cout << label << " " << std::hex << std::setw(16) << std::setfill('0') << digest(output)
+                  << std::dec << std::setfill(' ') << std::endl;
+        continue;
+      }
+
+      // The pipeline's float paths, in either order, must match the reference exactly
+      if (std::string(path.name) == "legacy") legacy_output = output;
+      if ((std::string(path.name) == "default" || std::string(path.name) == "morton")
+          && !bit_identical(output, legacy_output)) {
+        std::cout << "FAIL: " << label << " differs from " << case_names[c] << "/legacy" << std::endl;
+        failures++;
+      }
+      if (std::string(path.name) == "heights") {
+        cloud scalar_output = inputs[c];
+        flatten_height_scalar(scalar_output);
+        if (!bit_identical(output, scalar_output)) {
+          std::cout << "FAIL: " << label << " differs from the scalar height-only pass" << std::endl;
+          failures++;
+        }
+      }
+
+      std::string golden_filename = path_join(tests_dir, "golden/" + case_names[c] + "."
+                                              + (path.baseline ? "baseline" : path.name) + ".pcd");
+      if (update && path.baseline) continue; // only flatten_pcl.cpp writes these
+      if (update) {
+        if (!write_test_pcd(golden_filename, output)) {
+          std::cout << "FAIL: couldn't write " << golden_filename << std::endl;
+          failures++;
+        }
+        continue;
+      }
+      cloud golden;
+      if (!read_test_pcd(golden_filename, golden) || golden.size() != output.size()) {
+        std::cout << "FAIL: " << label << " has no matching golden file " << golden_filename << std::endl;
+        failures++;
+        continue;
+      }
+      float max_abs[4] = {0, 0, 0, 0};
+      for (size_t i = 0; i < output.size(); i++) {
+        for (int f = 0; f < 4; f++) {
+          max_abs[f] = std::max(max_abs[f], std::fabs(field(output[i], f) - field(golden[i], f)));
+        }
+      }
+      bool ok = true;
+      if (path.baseline) {
+        std::vector<std::string> lines;
+        size_t mismatches = 0;
+        read_baseline_lines(golden_filename, lines);
+        for (size_t i = 0; i < output.size() && i < lines.size(); i++) {
+          if (baseline_line(output[i]) != lines[i]) mismatches++;
+        }
+        if (mismatches > 0 || lines.size() != output.size()) {
+          std::cout << "FAIL: " << label << " prints " << mismatches << " points unlike flatten_pcl.cpp" << std::endl;
+          ok = false;
+        }
+      }
+      for (int f = 0; f < 4 && !path.baseline; f++) { // the baseline's output is rounded to 6 digits
+        ok = ok && max_abs[f] <= path.tolerances[f];
+        if (max_abs[f] > worst.max_abs[f]) {
+          worst.max_abs[f] = max_abs[f];
+          worst.where[f] = label;
+        }
+      }
+      if (path.baseline && ok) {
+        std::cout << "ok    " << std::left << std::setw(30) << label << std::right << " " << output.size()
+                  << " points print as flatten_pcl.cpp's" << std::endl;
+        continue;
+      }
+      std::cout << (ok ? "ok    " : "FAIL: ") << std::left << std::setw(30) << label << std::right
+                << " max |d| x " << max_abs[0] << "  y " << max_abs[1] << "  z " << max_abs[2]
+                << "  intensity " << max_abs[3] << std::endl;
+      if (!ok) failures++;
+    }
+    if (!update && !print_digests) failures += check_ground_labels(case_names[c], inputs[c]);
+  }
+
+  if (!update && !print_digests) failures += check_columnar();
+  if (!update && !print_digests) failures += check_packed_fields();
+
+  if (update) {
+    std::cout << "Golden files written to " << path_join(tests_dir, "golden") << std::endl;
+  } else if (!print_digests) {
+    std::cout << "Worst deviation from golden:";
+    for (int f = 0; f < 4; f++) {
+      std::cout << "  " << FIELD_NAMES[f] << " " << worst.max_abs[f];
+      if (!worst.where[f].empty()) std::cout << " (" << worst.where[f] << ")";
+    }
+    std::cout << std::endl;
+  }
+  if (failures > 0) std::cout << failures << " check(s) failed" << std::endl;
+  return failures > 0 ? 1 : 0;
+}
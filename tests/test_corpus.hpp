@@ -0,0 +1,92 @@
+#ifndef TEST_CORPUS_H
+#define TEST_CORPUS_H
+
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "pcd_io.hpp"
+
+/* Test clouds shared by regression_test and components_test */
+
+// Same fields as the golden files: x y z intensity, all F4
+struct test_point {
+  float x, y, z;
+  float intensity;
+};
+
+typedef std::vector<test_point> cloud;
+
+/* Small PRNG with a fixed definition, so generated clouds do not depend on
+ * the standard library's distributions */
+class test_rng {
+
+  private:
+  uint32_t state;
+
+  public:
+
+  test_rng(uint32_t seed) : state(seed) {}
+
+  float unit() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.0f / 16777216.0f);
+  }
+
+  float noise(float sigma) {
+    return sigma * (unit() + unit() + unit() + unit() - 2.0f);
+  }
+};
+
+/* Scan-order route over sloped, wavy terrain with objects above it */
+void generate_scan(cloud &points, int N = 4000) {
+  test_rng rng(42);
+  const int POINTS_PER_SWEEP = 500;
+  for (int i = 0; i < N; i++) {
+    float t = (float) i / N;
+    float angle = 2 * (float) M_PI * (i % POINTS_PER_SWEEP) / POINTS_PER_SWEEP;
+    float range = 2 + 40 * rng.unit();
+    float x = 120 * t + range * std::cos(angle);
+    float y = 10 * std::sin(3 * t) + range * std::sin(angle);
+    float ground = 0.05f * x + 0.02f * y + std::sin(x / 25);
+    float z = ground + ((rng.unit() < 0.3f) ? 5 * rng.unit() : rng.noise(0.05f));
+    points.push_back(test_point{x, y, z, (float) (int) (255 * rng.unit())});
+  }
+}
+
+/* Read a checked-in PCD with the native reader (no PCL needed) */
+bool read_test_pcd(std::string filename, cloud &points) {
+  std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+  pcd_header h;
+  pcd_point_decoder<test_point> decoder;
+  if (!ifs || !read_pcd_header(ifs, h) || !decoder.init(h)) return false;
+  points.resize(h.points);
+  if (h.data == "binary") {
+    std::vector<char> record(h.point_size);
+    for (test_point &p : points) {
+      if (!ifs.read(record.data(), h.point_size)) return false;
+      decoder.decode_binary(h, record.data(), p);
+    }
+    return true;
+  }
+  std::string line;
+  for (test_point &p : points) {
+    if (!std::getline(ifs, line) || !decoder.decode_ascii(line, p)) return false;
+  }
+  return h.data == "ascii";
+}
+
+bool write_test_pcd(std::string filename, const cloud &points) {
+  std::ofstream ofs(filename, std::ios_base::out | std::ios_base::binary);
+  ofs << "VERSION .7\nFIELDS x y z intensity\nSIZE 4 4 4 4\nTYPE F F F F\nCOUNT 1 1 1 1\n"
+      << "WIDTH " << points.size() << "\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\n"
+      << "POINTS " << points.size() << "\nDATA binary\n";
+  ofs.write((const char *) points.data(), points.size() * sizeof(test_point));
+  return (bool) ofs;
+}
+
+#endif // TEST_CORPUS_H
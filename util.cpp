@@ -1,7 +1,9 @@
-#include <algorithm> // std::min, std::max
+#include <algorithm> // std::min, std::max, std::replace, std::stable_sort
+#include <map>
 #include <sstream> // std::ostringstream
 #include <string>
 #include <cmath>
+#include <fnmatch.h>
 #include "util.h"
 
 int ceiling_divide(float a, float b) {
@@ -52,12 +54,12 @@ std::string filename_append(std::string input_filename, std::string suffix) {
 }
 
 // e.g. 1234567 --> "1.2 M"
-std::string format_number(int num) {
+std::string format_number(long long num) {
 	// First multiply by 10 to get one decimal place
 	num *= 10;
-	char SUFFIXES[] = {'K', 'M', 'B'};
+	char SUFFIXES[] = {'K', 'M', 'B', 'T', 'P'};
 	int suff_idx = -1;
-	while(num >= 10000) {
+	while(num >= 10000 && suff_idx < 4) {
 	  num /= 1000;
 		suff_idx++;
 	}
@@ -79,6 +81,14 @@ std::string bbox_to_str(bbox b) {
   return oss.str();
 }
 
+bool parse_bbox(std::string s, bbox *b) {
+  std::replace(s.begin(), s.end(), ',', ' ');
+  std::istringstream iss(s);
+  std::string rest;
+  if (!(iss >> b->minx >> b->miny >> b->maxx >> b->maxy) || (iss >> rest)) return false;
+  return (b->minx < b->maxx) && (b->miny < b->maxy);
+}
+
 // https://stackoverflow.com/questions/11140483/how-to-get-list-of-files-with-a-specific-extension-in-a-given-folder
 namespace fs = ::boost::filesystem;
 void get_files_with_ext(const fs::path &root, const std::string &ext,
@@ -94,6 +104,60 @@ void get_files_with_ext(const fs::path &root, const std::string &ext,
   }
 }
 
+bool glob_match(const std::string &pattern, const std::string &s) {
+  return fnmatch(pattern.c_str(), s.c_str(), 0) == 0;
+}
+
+static bool matches_any(const std::vector<std::string> &patterns, const std::string &name) {
+  for (std::string const &pattern : patterns) {
+    if (glob_match(pattern, name)) return true;
+  }
+  return false;
+}
+
+void find_input_files(const fs::path &root, const std::string &ext,
+                      const std::vector<std::string> &includes, const std::vector<std::string> &excludes,
+                      const fs::path &skip_dir, std::vector<input_file> &ret) {
+  boost::system::error_code ec;
+  if (!fs::is_directory(root, ec)) return;
+  fs::recursive_directory_iterator it(root);
+  fs::recursive_directory_iterator endit;
+  while (it != endit) {
+    // the entry's type comes from the directory read, so this does not stat
+    fs::file_type type = it->status(ec).type();
+    if (type == fs::directory_file) {
+      if (!skip_dir.empty() && fs::equivalent(it->path(), skip_dir, ec)) {
+        it.disable_recursion_pending();
+      }
+    } else if (type == fs::regular_file && it->path().extension() == ext) {
+      std::string name = it->path().filename().string();
+      if ((includes.empty() || matches_any(includes, name)) && !matches_any(excludes, name)) {
+        uintmax_t size = fs::file_size(it->path(), ec);
+        ret.push_back(input_file{it->path().string(), ec ? 0 : size});
+      }
+    }
+    ++it;
+  }
+}
+
+void sort_largest_first(std::vector<input_file> &files) {
+  std::stable_sort(files.begin(), files.end(),
+                   [](const input_file &a, const input_file &b) { return a.size > b.size; });
+}
+
+std::string output_basename(std::string input_filename, std::string ext) {
+  return replace_extension(filename_append(basename(input_filename), "_flat"), ext);
+}
+
+void find_output_collisions(const std::vector<input_file> &files, const std::string &ext,
+                            std::vector<std::pair<std::string, std::string> > &collisions) {
+  std::map<std::string, std::string> output_inputs;
+  for (input_file const &f : files) {
+    auto inserted = output_inputs.insert(std::make_pair(output_basename(f.path, ext), f.path));
+    if (!inserted.second) collisions.push_back(std::make_pair(inserted.first->second, f.path));
+  }
+}
+
 std::string basename(std::string filename) {
   ::boost::filesystem::path p(filename);
   return p.filename().string();
@@ -104,3 +168,9 @@ std::string path_join(std::string s1, std::string s2) {
   boost::filesystem::path p2(s2);
   return (p1 / p2).string();
 }
+
+// e.g. ("dir/a_flat.pcd", ".fcol") --> "dir/a_flat.fcol"
+std::string replace_extension(std::string filename, std::string ext) {
+  boost::filesystem::path p(filename);
+  return p.replace_extension(ext).string();
+}
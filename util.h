@@ -1,6 +1,8 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <string>
+#include <utility>
 #include <vector>
 
 #define BOOST_FILESYSTEM_VERSION 3
@@ -22,15 +24,40 @@ std::string string_slice(std::string s, int a, int b);
 
 std::string filename_append(std::string input_filename, std::string suffix);
 
-std::string format_number(int num);
+std::string format_number(long long num);
 
 std::string bbox_to_str(bbox b);
 
+// Parses "minx,miny,maxx,maxy"; returns false if malformed
+bool parse_bbox(std::string s, bbox *b);
+
 void get_files_with_ext(const ::boost::filesystem::path &root,
      const std::string &ext, std::vector<std::string> &ret);
+
+// Shell-style wildcard match (*, ?, [...]) of a whole string
+bool glob_match(const std::string &pattern, const std::string &s);
+
+// Files under root with extension ext, with their sizes, found in one walk.
+// A file's basename must match one of includes (if any) and none of excludes;
+// the skip_dir subtree (e.g. an output directory inside root) is not entered.
+void find_input_files(const ::boost::filesystem::path &root, const std::string &ext,
+     const std::vector<std::string> &includes, const std::vector<std::string> &excludes,
+     const ::boost::filesystem::path &skip_dir, std::vector<input_file> &ret);
+
+// Sort so the largest files come first, for longest-first scheduling
+void sort_largest_first(std::vector<input_file> &files);
+
+// Name of an input's output in the output directory, e.g. ("dir/a.pcd", ".fcol") --> "a_flat.fcol"
+std::string output_basename(std::string input_filename, std::string ext);
+
+// Pairs of inputs (first found, later one) that would be written to the same output name
+void find_output_collisions(const std::vector<input_file> &files, const std::string &ext,
+     std::vector<std::pair<std::string, std::string> > &collisions);
      
 std::string basename(std::string filename);
 
 std::string path_join(std::string s1, std::string s2);
 
+std::string replace_extension(std::string filename, std::string ext);
+
 #endif // UTIL_H
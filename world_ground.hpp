@@ -0,0 +1,244 @@
+#ifndef WORLD_GROUND_H
+#define WORLD_GROUND_H
+
+#include <algorithm> // std::nth_element
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "aux_types.h"
+#include "grid.hpp"
+#include "util.h" // int_clamp
+
+/* Ground grid anchored to world coordinates, kept across the frames of a
+ * sequence (--sequence). Cell (i, j) covers [i * s, (i + 1) * s) x
+ * [j * s, (j + 1) * s) whatever frame its points came from, so overlapping
+ * frames add to the same cells. Each cell keeps a histogram of its z's
+ * instead of the z's themselves: a frame adds its points in O(1) each, and
+ * only the cells it touched have their floor percentile re-read, from the
+ * histogram rather than by re-selecting over every point seen so far.
+ * A frame looks each world cell it covers up once, into a dense window over
+ * its grid, rather than hashing every point. A cell whose floor has held
+ * through several re-reads over many points is saturated: later frames
+ * neither add to its histogram nor re-read its floor. */
+
+const float WORLD_GROUND_BIN_LEN = 0.02;  // metres per histogram bin; floors are bin centres
+const float WORLD_GROUND_MAX_SPAN = 50;   // metres of z kept in a cell's histogram window
+const uint32_t WORLD_GROUND_ANCHOR_POINTS = 128; // z's a cell keeps as is before placing its window
+const uint32_t WORLD_GROUND_SATURATION_POINTS = 1024; // z's a cell needs before it can saturate
+const int WORLD_GROUND_STABLE_READS = 3;  // re-reads its floor must then hold through (same bin)
+
+/* std::floor to an integer, inline: without SSE4.1 std::floor is a libm
+ * call, and it runs twice per point here */
+inline int64_t floor_to_int(float v) {
+  int64_t t = (int64_t) v;
+  return t - (v < (float) t);
+}
+
+/* Histogram of z's over a window of at most max_bins bins. The window is
+ * placed once there are WORLD_GROUND_ANCHOR_POINTS z's, with their floor
+ * percentile a quarter of the way up, so a stray point far below or above
+ * the ground cannot anchor it. It then grows towards new z's while it
+ * spans at most max_bins; z's beyond that are only counted, below or above. */
+class z_histogram {
+
+  private:
+  int64_t first_bin;            // absolute bin of counts[0]
+  std::vector<uint32_t> counts; // empty until the window is placed
+  std::vector<float> anchor_zs; // the first z's, until then
+  uint32_t num_below;           // points below the first bin
+  uint32_t num_above;           // points above the last bin
+  uint32_t total;
+
+  static int64_t bin_of(float z, float bin_len) {
+    return floor_to_int(z / bin_len);
+  }
+
+  static float bin_center(int64_t b, float bin_len) {
+    return (b + 0.5f) * bin_len;
+  }
+
+  void count(int64_t b, int max_bins) {
+    int64_t last_bin = first_bin + (int64_t) counts.size() - 1;
+    if (b < first_bin) {
+      if (last_bin - b >= max_bins) {
+        num_below++;
+        return;
+      }
+      counts.insert(counts.begin(), first_bin - b, 0);
+      first_bin = b;
+    } else if (b > last_bin) {
+      if (b - first_bin >= max_bins) {
+        num_above++;
+        return;
+      }
+      counts.resize(b - first_bin + 1, 0);
+    }
+    counts[b - first_bin]++;
+  }
+
+  void place_window(float bin_len, int max_bins) {
+    std::vector<float> zs;
+    zs.swap(anchor_zs);
+    size_t k = zs.size() / 20; // the floor percentile, as in compute_floor_zs
+    std::nth_element(zs.begin(), zs.begin() + k, zs.end());
+    first_bin = bin_of(zs[k], bin_len) - max_bins / 4;
+    counts.assign(max_bins / 4 + 1, 0);
+    for (float z : zs) count(bin_of(z, bin_len), max_bins);
+  }
+
+  public:
+
+  z_histogram() : first_bin(0), num_below(0), num_above(0), total(0) {}
+
+  uint32_t size() const {
+    return total;
+  }
+
+  void add(float z, float bin_len, int max_bins) {
+    total++;
+    if (!counts.empty()) {
+      count(bin_of(z, bin_len), max_bins);
+      return;
+    }
+    anchor_zs.push_back(z);
+    if (anchor_zs.size() >= WORLD_GROUND_ANCHOR_POINTS) place_window(bin_len, max_bins);
+  }
+
+  /* The k-th smallest z (0-based) for k < size(): exact among the anchor
+   * z's, else the centre of its bin. Points counted below or above the
+   * window are taken to be in its first or last bin. */
+  float kth(uint32_t k, float bin_len) const {
+    if (counts.empty()) {
+      std::vector<float> zs(anchor_zs);
+      std::nth_element(zs.begin(), zs.begin() + k, zs.end());
+      return zs[k];
+    }
+    uint32_t seen = num_below;
+    if (seen > k) return bin_center(first_bin, bin_len);
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen > k) return bin_center(first_bin + (int64_t) i, bin_len);
+    }
+    return bin_center(first_bin + (int64_t) counts.size() - 1, bin_len); // among num_above
+  }
+};
+
+class world_ground {
+
+  private:
+  struct world_cell {
+    z_histogram zs;
+    float floor_z;
+    bool changed;     // points added since floor_z was read
+    bool saturated;   // floor_z is final; points are no longer added
+    int stable_reads; // consecutive re-reads that left floor_z in the same bin
+    world_cell() : floor_z(NAN), changed(false), saturated(false), stable_reads(0) {}
+  };
+
+  float cell_len;
+  unsigned int min_points_per_block;
+  int max_bins;
+  std::unordered_map<int64_t, world_cell> cells;
+  std::vector<world_cell *> window; // cells of the last frame's grid, NULL until touched
+  size_t floors_updated;  // by the last floor_zs() call
+  size_t floors_saturated; // among its cells
+
+  static int64_t cell_key(int64_t i, int64_t j) {
+    return (i << 32) ^ (j & 0xffffffff);
+  }
+
+  int64_t world_index(float coord) const {
+    return floor_to_int(coord / cell_len);
+  }
+
+  /* World index of the first column and row of pcl_grid (laid by align_grid) */
+  void grid_origin(grid &pcl_grid, int64_t *i0, int64_t *j0) const {
+    *i0 = (int64_t) std::floor(pcl_grid.origin_x() / cell_len + 0.5f);
+    *j0 = (int64_t) std::floor(pcl_grid.origin_y() / cell_len + 0.5f);
+  }
+
+  public:
+
+  world_ground(float cell_len, unsigned int min_points_per_block)
+      : cell_len(cell_len), min_points_per_block(min_points_per_block),
+        max_bins((int) (WORLD_GROUND_MAX_SPAN / WORLD_GROUND_BIN_LEN)), floors_updated(0),
+        floors_saturated(0) {}
+
+  size_t num_cells() const {
+    return cells.size();
+  }
+
+  size_t num_floors_updated() const {
+    return floors_updated;
+  }
+
+  size_t num_floors_saturated() const {
+    return floors_saturated;
+  }
+
+  /* Lay pcl_grid over the world cells covering box; returns the box it covers */
+  bbox align_grid(bbox box, grid &pcl_grid) const {
+    bbox aligned = box;
+    aligned.minx = world_index(box.minx) * cell_len;
+    aligned.miny = world_index(box.miny) * cell_len;
+    int w = (int) (world_index(box.maxx) - world_index(box.minx)) + 1;
+    int h = (int) (world_index(box.maxy) - world_index(box.miny)) + 1;
+    pcl_grid.set_window(aligned.minx, aligned.miny, h, w);
+    aligned.maxx = aligned.minx + w * cell_len;
+    aligned.maxy = aligned.miny + h * cell_len;
+    return aligned;
+  }
+
+  /* Add the z's of points, which lie in pcl_grid (laid by align_grid over
+   * them), to the histograms of their world cells, except saturated ones */
+  template <typename PointContainer>
+  void add_points(const PointContainer &points, grid &pcl_grid) {
+    int64_t i0, j0;
+    grid_origin(pcl_grid, &i0, &j0);
+    int h = pcl_grid.h(), w = pcl_grid.w();
+    window.assign(h * w, NULL);
+    for (auto const &p : points) {
+      int x = int_clamp((int) (world_index(p.x) - i0), 0, w - 1);
+      int y = int_clamp((int) (world_index(p.y) - j0), 0, h - 1);
+      world_cell *&cell = window[y * w + x];
+      if (!cell) cell = &cells[cell_key(i0 + x, j0 + y)];
+      if (cell->saturated) continue;
+      cell->zs.add(p.z, WORLD_GROUND_BIN_LEN, max_bins);
+      cell->changed = true;
+    }
+  }
+
+  /* Floor per cell of pcl_grid (laid by align_grid) as compute_floor_zs
+   * takes it, but over every point seen in the cell so far */
+  void floor_zs(grid &pcl_grid, std::vector<float> &floor_zs) {
+    int64_t i0, j0;
+    grid_origin(pcl_grid, &i0, &j0);
+    floor_zs.assign(pcl_grid.h() * pcl_grid.w(), 0);
+    floors_updated = 0;
+    floors_saturated = 0;
+    for (int y = 0; y < pcl_grid.h(); y++) {
+      for (int x = 0; x < pcl_grid.w(); x++) {
+        auto it = cells.find(cell_key(i0 + x, j0 + y));
+        if (it == cells.end()) continue;
+        world_cell &cell = it->second;
+        if (cell.zs.size() <= min_points_per_block) continue; // too few points yet
+        if (cell.changed) {
+          // floors read from the histogram are bin centres, so a floor in the same bin is equal
+          float z = cell.zs.kth(cell.zs.size() / 20, WORLD_GROUND_BIN_LEN);
+          cell.stable_reads = (z == cell.floor_z) ? cell.stable_reads + 1 : 0;
+          cell.saturated = cell.zs.size() >= WORLD_GROUND_SATURATION_POINTS
+                        && cell.stable_reads >= WORLD_GROUND_STABLE_READS;
+          cell.floor_z = z;
+          cell.changed = false;
+          floors_updated++;
+        }
+        if (cell.saturated) floors_saturated++;
+        floor_zs[y * pcl_grid.w() + x] = cell.floor_z;
+      }
+    }
+  }
+};
+
+#endif // WORLD_GROUND_H